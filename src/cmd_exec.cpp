@@ -789,6 +789,8 @@ static void cmd_list_exec(CmdList &cmd_list, PdfDocument &doc, bool test)
 // exec the command tree
 void doc_exec_commands(PdfDocument &doc, CmdList &cmd_list)
 {
+    // objects created by commands belong to the document
+    ArenaScope scope(&doc.obj_table.arena);
     cmd_list_exec(cmd_list, doc, true);// test arguments
     cmd_list_exec(cmd_list, doc, false);// execute commands
     cmd_list_free(cmd_list);
@@ -996,15 +998,12 @@ static bool cmd_del(PdfDocument &doc, Param params[], PageRanges &pages)
 // if provided {page_ranges} add blank pages at pos, else append to end
 static bool cmd_new(PdfDocument &doc, Param params[], PageRanges &pages)
 {
-    if (pages.array.front().type==PAGE_SET_ALL)
-        doc.newBlankPage(-1);
-    else {
-        pages.sort();
-        for (int page_num : pages) {
-            doc.newBlankPage(page_num);
-        }
+    if (pages.array.front().type==PAGE_SET_ALL) {
+        doc.appendBlankPages(1);
+        return true;
     }
-    return true;
+    pages.sort();
+    return doc.insertBlankPages(pages.page_num_array);
 }
 
 /*
@@ -1027,9 +1026,7 @@ static bool cmd_modulo(PdfDocument &doc, Param params[], PageRanges &pages)
 
     round = MAX(round, modulo);
     // add blank pages to make page_count integral multiple of 'round'
-    while (doc.page_list.count()%round){
-        doc.newBlankPage(-1);
-    }
+    doc.appendBlankPages((round - doc.page_list.count()%round) % round);
     PageRanges new_ranges;
 
     int pages_count = doc.page_list.count();
@@ -1055,10 +1052,8 @@ static bool cmd_modulo(PdfDocument &doc, Param params[], PageRanges &pages)
 
 static bool cmd_nup (PdfDocument &doc, Param params[], PageRanges &pages)
 {
-    int n, rows, cols, row, col;
+    int n, rows, cols;
     double dx, dy, margin_x, margin_y;
-    float scale, scale_x, scale_y, scaled_page_w, scaled_page_h,
-            cell_x, cell_y, move_x, move_y;
     Rect paper;// size of new paper
 
     n = params[0].integer;
@@ -1083,16 +1078,19 @@ static bool cmd_nup (PdfDocument &doc, Param params[], PageRanges &pages)
         else paper_set_orientation(paper, ORIENT_PORTRAIT);
     }
     // add required blank pages
-    while (doc.page_list.count() % n){
-        doc.newBlankPage(-1);
-    }
+    doc.appendBlankPages((n - doc.page_list.count()%n) % n);
     int pages_count = doc.page_list.count();
     // calculate available space for fitting each page
     float cell_w = ( paper.right.x - (2*margin_x) - (cols-1)*dx )/cols;
     float cell_h = ( paper.right.y - (2*margin_y) - (rows-1)*dy )/rows;
     // scale and move page to proper position
-    for (int page_index=0; page_index < pages_count; page_index++) {
-        PdfPage &page = doc.page_list[page_index];
+    PageRanges all_pages;
+    all_pages.append(PageRange(PAGE_SET_ALL));
+    all_pages.initPageNums(pages_count);
+    doc_pages_foreach(doc, all_pages, [&](PdfPage &page, int page_num) {
+        int page_index = page_num-1, row, col;
+        float scale, scale_x, scale_y, scaled_page_w, scaled_page_h,
+                cell_x, cell_y, move_x, move_y;
         Rect page_size = page.pageSize();
         scale_x = cell_w/(page_size.right.x - page_size.left.x);
         scale_y = cell_h/(page_size.right.y - page_size.left.y);
@@ -1113,28 +1111,28 @@ static bool cmd_nup (PdfDocument &doc, Param params[], PageRanges &pages)
         matrix.scale(scale);
         matrix.translate(move_x, move_y);
         page.transform(matrix);
-    }
-    // create new blank pages and merge old pages
+    });
+    // create new blank pages after old pages, and merge each n old pages into one
     int loops = pages_count / n;
+    doc.appendBlankPages(loops);
     for (int i=0; i<loops; i++) {
-        doc.newBlankPage(-1);
-        PdfPage &new_page = doc.page_list[doc.page_list.count()-1];//last page
+        PdfPage &new_page = doc.page_list[pages_count+i];
         new_page.paper = paper;
         for (int j=0; j<n; j++) {
-            PdfPage &page = doc.page_list[0];
-            new_page.mergePage(page);
-            doc.page_list.remove(0);
+            new_page.mergePage(doc.page_list[i*n+j]);
         }
     }
+    // remove the old pages
+    std::vector<bool> keep(pages_count, false);
+    keep.resize(doc.page_list.count(), true);
+    doc.page_list.filter(keep);
     return true;
 }
 
 // centerfold booklet format, (use along with nup)
 static bool cmd_book (PdfDocument &doc, Param params[], PageRanges &pages)
 {
-    while (doc.page_list.count()%4){
-        doc.newBlankPage(-1);
-    }
+    doc.appendBlankPages((4 - doc.page_list.count()%4) % 4);
     int pages_count = doc.page_list.count();
     PageRanges new_ranges;
 
@@ -1206,7 +1204,7 @@ static bool cmd_scaleto2 (PdfDocument &doc, Param params[], PageRanges &pages)
 
 static bool cmd_rotate (PdfDocument &doc, Param params[], PageRanges &pages)
 {
-    int w, h, angle = params[0].integer;
+    int angle = params[0].integer;
     if (angle%90 != 0) {
         message(ERROR, "rotation angle must be multiple of 90");
         return false;
@@ -1216,12 +1214,11 @@ static bool cmd_rotate (PdfDocument &doc, Param params[], PageRanges &pages)
     Matrix rot_matrix;
     rot_matrix.rotate(angle);
 
-    for (int page_num : pages){
-        PdfPage &page = doc.page_list[page_num-1];
+    doc_pages_foreach(doc, pages, [&](PdfPage &page, int page_num) {
         Rect page_size = page.pageSize();
         Matrix matrix = rot_matrix;
-        w = page_size.right.x;
-        h = page_size.right.y;
+        int w = page_size.right.x;
+        int h = page_size.right.y;
         switch (angle){
             case 90:
                 matrix.translate(0, w);
@@ -1234,7 +1231,7 @@ static bool cmd_rotate (PdfDocument &doc, Param params[], PageRanges &pages)
                 break;
         }
         page.transform(matrix);
-    }
+    });
     return true;
 }
 
@@ -1242,26 +1239,23 @@ static bool cmd_rotate (PdfDocument &doc, Param params[], PageRanges &pages)
 static bool cmd_flip (PdfDocument &doc, Param params[], PageRanges &pages)
 {
     int mode = str_to_id(params[0].str, ids_orient, get_ids_len(ids_orient));
-
-    for (int page_num : pages){
-        PdfPage &page = doc.page_list[page_num-1];
+    if (mode!=ORIENT_LANDSCAPE && mode!=ORIENT_PORTRAIT) {
+        message(ERROR, "invalid flip mode, use v or h");
+        return false;
+    }
+    doc_pages_foreach(doc, pages, [&](PdfPage &page, int page_num) {
         Rect page_size = page.pageSize();
         Matrix matrix;
-        switch (mode) {
-            case ORIENT_LANDSCAPE:// rotate 180 deg along x axis (vertically)
-                matrix.mat[1][1] = -1;
-                matrix.mat[2][1] = page_size.right.y;
-                break;
-            case ORIENT_PORTRAIT:// rotate 180 deg along y axis (horizontally)
-                matrix.mat[0][0] = -1;
-                matrix.mat[2][0] = page_size.right.x;
-                break;
-            default:
-                message(ERROR, "invalid flip mode, use v or h");
-                return false;
+        if (mode==ORIENT_LANDSCAPE) {// rotate 180 deg along x axis (vertically)
+            matrix.mat[1][1] = -1;
+            matrix.mat[2][1] = page_size.right.y;
+        }
+        else {// rotate 180 deg along y axis (horizontally)
+            matrix.mat[0][0] = -1;
+            matrix.mat[2][0] = page_size.right.x;
         }
         page.transform(matrix);
-    }
+    });
     return true;
 }
 
@@ -1286,11 +1280,10 @@ static bool cmd_text (PdfDocument &doc, Param params[], PageRanges &pages)
 
 static bool cmd_line (PdfDocument &doc, Param params[], PageRanges &pages)
 {
-    for (int page_num : pages){
-        PdfPage &page = doc.page_list[page_num-1];
+    doc_pages_foreach(doc, pages, [&](PdfPage &page, int page_num) {
         page.drawLine(Point(params[0].real, params[1].real),
                       Point(params[2].real, params[3].real), params[4].real);
-    }
+    });
     return true;
 }
 
@@ -1,15 +1,31 @@
 /* This file is a part of pdfcook program, which is GNU GPLv2 licensed */
 #include "common.h"
+#include <thread>
+
+int thread_count()
+{
+    if (num_threads>0)
+        return num_threads;
+    return MAX(1, (int)std::thread::hardware_concurrency());
+}
 
 // read a big endian integer provided as char array
-int arr2int(char *arr, int len)
+uint64_t arr2int(const char *arr, int len)
 {
-    unsigned char tmp[4] = {};
+    // network byte order is big endian, eg. int 16 is stored as 0x000010 in 3 bytes
+    uint64_t val = 0;
     for (int i=0; i<len; i++) {
-        tmp[4-len+i] = arr[i];
+        val = (val<<8) | (unsigned char)arr[i];
+    }
+    return val;
+}
+
+void int2arr(uint64_t val, char *arr, int len)
+{
+    for (int i=len-1; i>=0; i--) {
+        arr[i] = val & 0xff;
+        val >>= 8;
     }
-    // network byte order is big endian, eg. int 16 is stored as 0x000010 in 3 bytes
-    return ((uint)tmp[0]<<24 | (uint)tmp[1]<<16 | (uint)tmp[2]<<8 | (uint)tmp[3] );
 }
 
 
@@ -51,9 +67,66 @@ int asprintf(char **strp, const char *fmt, ...){
 }
 #endif
 
+// write integer in buf (of at least 21 bytes) and returns length of string
+int int2str(int64_t val, char *buf)
+{
+    char tmp[24];
+    int len = 0;
+    uint64_t uval = val<0 ? -(uint64_t)val : val;
+    do {
+        tmp[len++] = '0' + uval%10;
+        uval /= 10;
+    } while (uval);
+    char *p = buf;
+    if (val<0)
+        *p++ = '-';
+    while (len)
+        *p++ = tmp[--len];
+    *p = 0;
+    return p-buf;
+}
+
+// write real number in buf like %f but strips trailing zeros, and returns length.
+// buf must be at least 32 bytes. returns -1 if number is too large to format here
+int real2str(double real, char *buf)
+{
+    double scaled = fabs(real) * 1000000.0;
+    if (!(scaled < 1e12))// also true for NaN
+        return -1;
+    double int_val = floor(scaled);
+    double frac = scaled - int_val;
+    // scaled has little rounding error. When it is close to halfway between two integers
+    // the correct rounding can not be known, so use snprintf() to get same result as %f
+    if (fabs(frac-0.5) < 0.001)
+        return -1;
+    unsigned long long n = (unsigned long long) int_val + (frac > 0.5);
+    char *p = buf;
+    if (std::signbit(real))// %f prints -0.000000 for negative numbers rounded to zero
+        *p++ = '-';
+    p += int2str(n/1000000, p);
+    *p++ = '.';
+    int frac_digits = n%1000000;
+    if (frac_digits==0) {// keep a zero after decimal point eg. 2.0
+        *p++ = '0';
+    }
+    else {
+        for (int div=100000; frac_digits; div/=10) {
+            *p++ = '0' + frac_digits/div;
+            frac_digits %= div;
+        }
+    }
+    *p = 0;
+    return p-buf;
+}
+
 // like %f but strips trailing zeros
 std::string double2str(double real)
 {
+    char tmp[32];
+    int tmp_len = real2str(real, tmp);
+    if (tmp_len>=0)
+        return std::string(tmp, tmp_len);
+
     int len = std::snprintf(nullptr, 0, "%f", real);// get length
     char buf[len+1];
     std::snprintf(buf, len+1, "%f", real);
@@ -63,3 +136,102 @@ std::string double2str(double real)
         len++;
     return std::string(buf, len);
 }
+
+
+// *********** ------------- Arena ----------------- ***********
+#define ARENA_BLOCK_SIZE 65536
+// allocations larger than this get a separate block
+#define ARENA_LARGE_ALLOC (ARENA_BLOCK_SIZE/4)
+#define ARENA_ALIGN 8
+
+Arena:: Arena()
+{
+    ptr = end = NULL;
+    buffers = NULL;
+}
+
+Arena:: ~Arena()
+{
+    for (Buffer *buf = buffers; buf!=NULL; buf = buf->next) {
+        if (buf->ptr!=NULL)
+            free(*buf->ptr);
+    }
+    for (char *block : blocks) {
+        free(block);
+    }
+}
+
+void* Arena:: alloc (size_t size)
+{
+    size = (size + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
+    if (size > (size_t)(end-ptr)) {
+        if (size > ARENA_LARGE_ALLOC) {
+            // current block is kept, so that its free space remains usable
+            char *block = (char*) malloc2(size);
+            blocks.push_back(block);
+            return block;
+        }
+        ptr = (char*) malloc2(ARENA_BLOCK_SIZE);
+        end = ptr + ARENA_BLOCK_SIZE;
+        blocks.push_back(ptr);
+    }
+    void *mem = ptr;
+    ptr += size;
+    return mem;
+}
+
+char* Arena:: copyString (const char *str, size_t len)
+{
+    char *copy = (char*) alloc(len+1);
+    memcpy(copy, str, len);
+    copy[len] = 0;
+    return copy;
+}
+
+Arena::Buffer* Arena:: ownBuffer (char **ptr)
+{
+    Buffer *buf = (Buffer*) alloc(sizeof(Buffer));
+    buf->ptr = ptr;
+    buf->next = buffers;
+    buffers = buf;
+    return buf;
+}
+
+void Arena:: adopt (Arena &src)
+{
+    blocks.insert(blocks.end(), src.blocks.begin(), src.blocks.end());
+    src.blocks.clear();
+    src.ptr = src.end = NULL;
+    if (src.buffers) {
+        Buffer *last = src.buffers;
+        while (last->next)
+            last = last->next;
+        last->next = buffers;
+        buffers = src.buffers;
+        src.buffers = NULL;
+    }
+}
+
+static thread_local Arena *cur_arena = NULL;
+
+/* objects created outside of any arena scope are freed at exit. Default arena
+ is not thread safe, so other threads must always set an arena scope */
+Arena* current_arena()
+{
+    if (cur_arena==NULL) {
+        static Arena default_arena;
+        return &default_arena;
+    }
+    return cur_arena;
+}
+
+ArenaScope:: ArenaScope(Arena *arena)
+{
+    prev = cur_arena;
+    cur_arena = arena;
+}
+
+ArenaScope:: ~ArenaScope()
+{
+    cur_arena = prev;
+}
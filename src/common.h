@@ -9,10 +9,14 @@
 #include <cstring>// memcpy and other string func
 #include <cassert>
 #include <cmath>
-//#include <cstdint> // uint32_t type
+#include <vector>
+#include <cstdint> // int64_t type
 //#include <cctype> // toupper() isspace() etc
 
 extern bool repair_mode;
+extern int num_threads;
+extern bool objstm_mode;
+extern int compress_level;
 
 typedef unsigned int uint;
 // M_PI is not available in mingw32, so using and defining PI
@@ -28,11 +32,19 @@ int asprintf(char **strp, const char *fmt, ...);
 #define MAX(a,b) ((a)>(b) ? (a):(b))
 #define MIN(a,b) ((a)<(b) ? (a):(b))
 
-// read a big endian integer provided as char array
-int arr2int(char *arr, int len);
+// number of worker threads, set by -j option or else number of cpu cores
+int thread_count();
+
+// read a big endian integer (of atmost 8 bytes) provided as char array
+uint64_t arr2int(const char *arr, int len);
+// store an integer as big endian in char array of length len
+void int2arr(uint64_t val, char *arr, int len);
 
 // like %f but strips trailing zeros
 std::string double2str(double num);
+// fast formatting of numbers in a buffer, returns length of string
+int int2str(int64_t val, char *buf);
+int real2str(double real, char *buf);
 
 // like malloc() but exits program when fails. use this where little memroy
 // is needed, and where we can not ignore the allocation failure
@@ -45,3 +57,41 @@ inline void* malloc2(size_t size)
     }
     return ptr;
 }
+
+
+/* Bump allocator. Memory is taken from large blocks, and all of it is freed at
+ once when the arena is destroyed. Freeing a single allocation does nothing. */
+class Arena
+{
+public:
+    // a heap buffer which is freed with the arena, unless released before that
+    struct Buffer {
+        char **ptr;// NULL if released
+        Buffer *next;
+    };
+    Arena();
+    ~Arena();
+    void* alloc (size_t size);
+    char* copyString (const char *str, size_t len);// returns null terminated copy
+    Buffer* ownBuffer (char **ptr);
+    void adopt (Arena &src);// take all memory of src arena, src becomes empty
+private:
+    char *ptr, *end;// free space in current block
+    std::vector<char*> blocks;
+    Buffer *buffers;
+    Arena(const Arena&);// not copyable
+    Arena& operator= (const Arena&);
+};
+
+// arena used for allocations of current thread
+Arena* current_arena();
+
+// sets current arena of this thread for its lifetime, and restores previous one after that
+class ArenaScope
+{
+public:
+    ArenaScope(Arena *arena);
+    ~ArenaScope();
+private:
+    Arena *prev;
+};
@@ -8,3 +8,22 @@
 
 /* have asprintf() func */
 #define HAVE_ASPRINTF 1
+
+/* have mmap() to map input files in memory (set 0 on windows) */
+#define HAVE_MMAP 1
+
+/* have writev() to write buffered data and stream data in one system call */
+#define HAVE_WRITEV 1
+
+/* use SSE2 instructions to scan pdf syntax 16 bytes at a time (always on x86-64) */
+#if defined(__SSE2__)
+#define HAVE_SSE2 1
+#else
+#define HAVE_SSE2 0
+#endif
+
+/* use libdeflate (faster than zlib) to compress output streams.
+ enabled by building with `make LIBDEFLATE=1` */
+#ifndef HAVE_LIBDEFLATE
+#define HAVE_LIBDEFLATE 0
+#endif
@@ -36,36 +36,36 @@ Crypt:: getEncryptionInfo(PdfObject *encrypt_dict, PdfObject *p_trailer)
     if (!encrypt_dict || !p_trailer)
         return false;
     int str_type;
-    PdfObject *obj = encrypt_dict->dict->get("Filter");
-    if (obj && obj->type==PDF_OBJ_NAME && strcmp(obj->name, "Standard")!=0){
-        debug("error : unsupported Encrypt filter '%s'", obj->name);
+    PdfObject *obj = encrypt_dict->dict->get(NAME_Filter);
+    if (obj && obj->type==PDF_OBJ_NAME && obj->name!=NAME_Standard){
+        debug("error : unsupported Encrypt filter '%s'", atom_name(obj->name));
         return false;
     }
-    obj = encrypt_dict->dict->get("V");
+    obj = encrypt_dict->dict->get(NAME_V);
     if (isInt(obj)){
         this->version = obj->integer;
     }
-    obj = encrypt_dict->dict->get("R");
+    obj = encrypt_dict->dict->get(NAME_R);
     if (isInt(obj)){
         this->revision = obj->integer;
     }
-    obj = encrypt_dict->dict->get("Length");
+    obj = encrypt_dict->dict->get(NAME_Length);
     if (isInt(obj)){
         this->keylen = obj->integer/8;// converting bits to bytes
     }
-    obj = encrypt_dict->dict->get("U");
+    obj = encrypt_dict->dict->get(NAME_U);
     if (obj){
         if (obj->type==PDF_OBJ_STR) {
-            this->U = pdfstr2bytes(obj->str, &str_type);
+            this->U = pdfstr2bytes(*obj->str, &str_type);
         }
         else {
             debug("error : Encrypt dict /U entry is not string obj");
             return false;
         }
     }
-    obj = encrypt_dict->dict->get("O");
+    obj = encrypt_dict->dict->get(NAME_O);
     if (isString(obj)){
-        this->O = pdfstr2bytes(obj->str, &str_type);
+        this->O = pdfstr2bytes(*obj->str, &str_type);
         if (this->O.size()!=32){
             debug("error : Encrypt dict /O entry size is not 32");
             return false;
@@ -75,15 +75,15 @@ Crypt:: getEncryptionInfo(PdfObject *encrypt_dict, PdfObject *p_trailer)
         debug("error : Encrypt dict does not have valid /O entry");
         return false;
     }
-    obj = encrypt_dict->dict->get("P");
+    obj = encrypt_dict->dict->get(NAME_P);
     if (isInt(obj)){
         this->perm = obj->integer;
     }
     // if any previous fails, id0 val will be empty
-    obj = p_trailer->dict->get("ID");
+    obj = p_trailer->dict->get(NAME_ID);
     if (isArray(obj) && obj->array->count()==2) {
         PdfObject *id_obj = obj->array->at(0);
-        this->id0 = pdfstr2bytes(id_obj->str, &str_type);
+        this->id0 = pdfstr2bytes(*id_obj->str, &str_type);
     }
     else {
         debug("error : failed to get trailer ID for decryption");
@@ -187,38 +187,26 @@ Crypt:: authenticate(const char *password)
 void decryptObject(PdfObject *obj, std::string key)
 {
     RC4 rc4(key);
-
-    switch (obj->type){
-        case PDF_OBJ_STR:
-            if (obj->str.len>0 && obj->str.data!=NULL){
-                int str_type;
-                std::string str = pdfstr2bytes(obj->str, &str_type);
-                char *str_data = (char*) malloc2(str.size());
-                memcpy(str_data, str.data(), str.size());
-                rc4.crypt((uchar*)str_data, str.size());
-                bytes2pdfstr(std::string(str_data, str.size()), obj->str, str_type);
-            }
-            return;
-        case PDF_OBJ_ARRAY:
-            for (auto child : *obj->array) {
-                decryptObject(child, key);
-            }
-            return;
-        case PDF_OBJ_DICT:
-            for (auto it : *obj->dict){
-                decryptObject(it.second, key);
-            }
-            return;
-        case PDF_OBJ_STREAM:
-            if (obj->stream->len>0 && obj->stream->stream){
-                rc4.crypt((uchar*)obj->stream->stream, obj->stream->len);
-            }
-            for (auto it : obj->stream->dict){
-                decryptObject(it.second, key);
-            }
-            return;
-        default:
-            return;
+    ObjectWalker walker(obj);
+
+    while ((obj = walker.next()) != NULL) {
+        switch (obj->type){
+            case PDF_OBJ_STR:
+                if (obj->str->len>0 && obj->str->data!=NULL){
+                    int str_type;
+                    std::string str = pdfstr2bytes(*obj->str, &str_type);
+                    rc4.crypt((uchar*)&str[0], str.size());
+                    bytes2pdfstr(str, *obj->str, str_type);
+                }
+                break;
+            case PDF_OBJ_STREAM:
+                if (obj->stream->len>0 && obj->stream->load()){
+                    rc4.crypt((uchar*)obj->stream->stream, obj->stream->len);
+                }
+                break;
+            default:
+                break;
+        }
     }
 }
 
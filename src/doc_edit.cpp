@@ -81,36 +81,142 @@ PageNumIter PageRanges:: end() {
 }
 
 
-bool doc_pages_delete (PdfDocument &doc, PageRanges &pages)
+/* load all objects reachable from obj, so that they are not read from input file
+ while pages are edited by multiple threads. /Parent entries are not followed, as
+ parent Pages node leads to all other pages. Objects are walked using a stack. */
+static void load_objects (PdfObject *obj, ObjectTable &table, std::vector<bool> &loaded)
+{
+    std::vector<PdfObject*> stack(1, obj);
+    while (not stack.empty()) {
+        obj = stack.back();
+        stack.pop_back();
+        switch (obj->type) {
+            case PDF_OBJ_INDIRECT_REF: {
+                int major = obj->indirect.major;
+                if (major<=0 || major>=(int)loaded.size() || loaded[major])
+                    break;
+                loaded[major] = true;
+                PdfObject *target = table.getObject(major, obj->indirect.minor);
+                if (target!=NULL)
+                    stack.push_back(target);
+                break;
+            }
+            case PDF_OBJ_ARRAY:
+                for (PdfObject *item : *obj->array)
+                    stack.push_back(item);
+                break;
+            case PDF_OBJ_DICT:
+                for (auto it : *obj->dict) {
+                    if (it.first!=NAME_Parent)
+                        stack.push_back(it.second);
+                }
+                break;
+            case PDF_OBJ_STREAM:
+                for (auto it : obj->stream->dict) {
+                    stack.push_back(it.second);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/* Converting a page to xobject modifies the page object and its content streams, and
+ objects not loaded yet are read from input file. So pages can be edited by multiple
+ threads only if no two pages share these objects, and all objects used by the pages
+ are loaded before */
+static bool pages_are_independent (PdfDocument &doc, PageRanges &pages)
 {
-    pages.sort();
-    int deleted = 0;
+    // stream data can not be read from a file (which is not in memory) by many threads
+    for (MYFILE *f : doc.input_files) {
+        if (f->f!=NULL)
+            return false;
+    }
+    ObjectTable &table = doc.obj_table;
+    std::vector<bool> used(table.count(), false);
+    std::vector<bool> loaded(table.count(), false);
+    // returns false if obj is an object used by other page, or it can not be loaded
+    auto use = [&](PdfObject *obj) {
+        if (not isRef(obj))
+            return true;
+        int major = obj->indirect.major;
+        if (major>=table.count() || used[major] || derefObject(obj, table)==NULL)
+            return false;
+        used[major] = true;
+        return true;
+    };
     for (int page_num : pages) {
-        doc.page_list.remove(page_num-1-deleted);
-        deleted++;
+        if (page_num<1 || page_num>doc.page_list.count())
+            return false;
+        PdfPage &page = doc.page_list[page_num-1];
+        if (used[page.major])
+            return false;
+        used[page.major] = true;
+        PdfObject *page_obj = table.getObject(page.major, page.minor);
+        if (not isDict(page_obj))
+            return false;
+        load_objects(page_obj, table, loaded);
+        if (not page.compressed)
+            continue;// content stream was created for this page only, when it was converted
+        PdfObject *contents = page_obj->dict->get(NAME_Contents);
+        if (not use(contents))
+            return false;
+        contents = derefObject(contents, table);
+        if (isArray(contents)) {
+            for (PdfObject *item : *contents->array) {
+                if (not use(item))
+                    return false;
+            }
+        }
     }
     return true;
 }
 
-bool doc_pages_arrange (PdfDocument &doc, PageRanges &pages)
+/* call func(page, page_num) for each page. When pages are independent, they are edited
+ by multiple threads. Objects added while editing a page are put in slots reserved for
+ that page, so the object numbers and output are same with any number of threads */
+void doc_pages_foreach (PdfDocument &doc, PageRanges &pages, PageFunc func)
+{
+    size_t count = pages.page_num_array.size();
+    if (count==0)
+        return;
+    int n_threads = pages_are_independent(doc, pages) ? thread_count() : 1;
+    int first_slot = doc.obj_table.reserveSlots(count * PAGE_XOBJ_SLOTS);
+    parallel_for(count, n_threads, NULL, doc.obj_table.arena, [&](size_t i, MYFILE*) {
+        int slot = first_slot + i*PAGE_XOBJ_SLOTS;
+        SlotScope scope(&doc.obj_table, slot, slot + PAGE_XOBJ_SLOTS);
+        int page_num = pages.page_num_array[i];
+        func(doc.page_list[page_num-1], page_num);
+    });
+}
+
+bool doc_pages_delete (PdfDocument &doc, PageRanges &pages)
 {
-    PageList pg_list = doc.page_list;//copies page list
-    doc.page_list.clear();
+    std::vector<bool> keep(doc.page_list.count(), true);
     for (int page_num : pages) {
-        if (page_num > pg_list.count())
+        if (page_num<1 || page_num>doc.page_list.count())
             return false;
-        PdfPage page = pg_list[page_num-1];
-        doc.page_list.append(page);
+        keep[page_num-1] = false;
     }
+    doc.page_list.filter(keep);
     return true;
 }
 
+bool doc_pages_arrange (PdfDocument &doc, PageRanges &pages)
+{
+    std::vector<int> indexes;
+    indexes.reserve(pages.page_num_array.size());
+    for (int page_num : pages) {
+        indexes.push_back(page_num-1);
+    }
+    return doc.page_list.gather(indexes);
+}
+
 bool doc_pages_number (PdfDocument &doc, PageRanges &pages,
                     int x, int y, int start, const char *text, int size, const char *font_name)
 {
     start -= 1;// this will help to calc page number to print
-    Point poz;
-    char *str;
     // make sure that given text contains a %d, which is replaced by page number
     const char *p1 = strstr(text, "%d");// find %d in the given text
     const char *p2 = strstr(text, "%");// first % is followed by d
@@ -124,10 +230,11 @@ bool doc_pages_number (PdfDocument &doc, PageRanges &pages,
     }
     Font font = doc.newFontObject(font_name);
 
-    for (int page_num : pages) {
+    doc_pages_foreach(doc, pages, [&](PdfPage &page, int page_num) {
         if (page_num-start<1)
-            continue;
-        PdfPage &page = doc.page_list[page_num-1];// page index = page_num -1
+            return;
+        Point poz;
+        char *str;
         Rect page_size = page.pageSize();
         poz.x = (x!=-1) ? page_size.left.x +x :
                         page_size.left.x + (page_size.right.x - page_size.left.x)/2;
@@ -135,68 +242,60 @@ bool doc_pages_number (PdfDocument &doc, PageRanges &pages,
         asprintf(&str, text, page_num-start);
         page.drawText(str, poz, size, font);
         free(str);
-    }
+    });
     return true;
 }
 
 bool doc_pages_text (PdfDocument &doc, PageRanges &pages,
                     int x, int y, const char *text, int size, const char *font_name)
 {
-    Point poz;
     Font font = doc.newFontObject(font_name);
 
-    for (int page_num : pages) {
-        PdfPage &page = doc.page_list[page_num-1];// page index = page_num -1
+    doc_pages_foreach(doc, pages, [&](PdfPage &page, int page_num) {
+        Point poz;
         Rect page_size = page.pageSize();
         poz.x = page_size.left.x + x;
         poz.y = page_size.left.y + y;
         page.drawText(text, poz, size, font);
-    }
+    });
     return true;
 }
 
 bool doc_pages_crop (PdfDocument &doc, PageRanges &pages, Rect crop_area)
 {
-    for (int page_num : pages){
-        PdfPage &page = doc.page_list[page_num-1];
+    doc_pages_foreach(doc, pages, [&](PdfPage &page, int page_num) {
         page.crop(crop_area);
-    }
+    });
     return true;
 }
 
 bool doc_pages_transform(PdfDocument &doc, PageRanges &pages, Matrix mat)
 {
-    for (int page_num : pages) {
-        PdfPage &page = doc.page_list[page_num-1];// page index = page_num -1
+    doc_pages_foreach(doc, pages, [&](PdfPage &page, int page_num) {
         page.transform(mat);
-    }
+    });
     return true;
 }
 
 bool doc_pages_translate(PdfDocument &doc, PageRanges &pages, float x, float y)
 {
-    Rect paper;
-
     Matrix  matrix;
     matrix.translate(x,y);
 
-    for (int page_num : pages) {
-        PdfPage &page = doc.page_list[page_num-1];
+    doc_pages_foreach(doc, pages, [&](PdfPage &page, int page_num) {
         Rect page_size = page.pageSize();
         // this transforms page content, paper size
         page.transform(matrix);
         // we dont want to transform paper so restoring it
         page.paper = page_size;
-    }
+    });
     return true;
 }
 
 bool doc_pages_scaleto (PdfDocument &doc, PageRanges &pages, Rect paper,
                         float top, float right, float bottom, float left)//margins
 {
-    double scale, scale_x, scale_y;
-    double move_x, move_y;
-    double old_page_w, old_page_h, avail_w, avail_h;
+    double avail_w, avail_h;
 
     Rect bbox = paper;
     bbox.right.x -= right;
@@ -207,8 +306,10 @@ bool doc_pages_scaleto (PdfDocument &doc, PageRanges &pages, Rect paper,
     avail_w = bbox.right.x - bbox.left.x;
     avail_h = bbox.right.y - bbox.left.y;
 
-    for (int page_num : pages){
-        PdfPage &page = doc.page_list[page_num-1];
+    doc_pages_foreach(doc, pages, [&](PdfPage &page, int page_num) {
+        double scale, scale_x, scale_y;
+        double move_x, move_y;
+        double old_page_w, old_page_h;
         Rect page_size = page.pageSize();
         // using paper size instead of bounding box size, because viewers show paper
         // size as page size, and you dont see the bounding box rect in a viewer
@@ -235,7 +336,7 @@ bool doc_pages_scaleto (PdfDocument &doc, PageRanges &pages, Rect paper,
 
         page.transform(matrix);
         page.paper = paper;
-    }
+    });
     return true;
 }
 
@@ -2,6 +2,7 @@
 /* This file is a part of pdfcook program, which is GNU GPLv2 licensed */
 #include "pdf_doc.h"
 #include <list>
+#include <functional>
 
 typedef enum {
     PAGE_SET_ALL,
@@ -15,8 +16,8 @@ class PageRange
 {
 public:
     PageSetType type;
-    int16_t begin;
-    int16_t end;
+    int begin;
+    int end;
     bool negative;
 
     PageRange ();
@@ -40,6 +41,9 @@ public:
     PageNumIter end();
 };
 
+typedef std::function<void(PdfPage &page, int page_num)> PageFunc;
+// call func for each page, in multiple threads if possible
+void doc_pages_foreach(PdfDocument &doc, PageRanges &pages, PageFunc func);
 
 bool doc_pages_transform(PdfDocument &doc, PageRanges &pages, Matrix mat);
 
@@ -4,9 +4,24 @@
 #include "fileio.h"
 #include "debug.h"
 #include "common.h"
+#include <cstdarg>
+#if (HAVE_MMAP)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if (HAVE_WRITEV)
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
 
 // 16KB buffer for MYFILE
 #define BUFSIZE 16384
+// 1MB buffer for OutFile. data larger than this is written without buffering
+#define OUT_BUFSIZE 1048576
+#define OUT_DIRECT_LEN 65536
 
 #define crlf(x) (((x)=='\r') || ((x)=='\n'))
 
@@ -39,16 +54,73 @@ MYFILE * streamopen(const char *str, size_t len)
     f->end = f->buf + len;
     f->pos = len;
     f->eof = EOF;// means no data left to read from string
+    f->mapped = false;
+    f->shared = false;
     f->row = 1;
     f->column = 0;
     f->lastc = 0;
     return f;
 }
 
+MYFILE * myfdup(MYFILE *stream)
+{
+    if (stream->f!=NULL){
+        return NULL;
+    }
+    MYFILE *f = (MYFILE*) malloc2(sizeof(MYFILE));
+    memcpy(f, stream, sizeof(MYFILE));
+    f->ptr = f->buf;
+    f->mapped = false;
+    f->shared = true;
+    return f;
+}
+
+#if (HAVE_MMAP)
+/* Map the whole file in memory. As there is no FILE, seeking and reading are
+ done same as a MYFILE created from string, and the buffer never needs refill.
+ Returns NULL if file can not be mapped (eg. empty file) */
+static MYFILE * mapfile(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd==-1)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st)==-1 || st.st_size<=0){
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);// mapping remains valid after closing fd
+    if (map==MAP_FAILED)
+        return NULL;
+
+    MYFILE *f = (MYFILE*) malloc2(sizeof(MYFILE));
+    f->f = NULL;
+    f->buf = (unsigned char*) map;
+    f->ptr = f->buf;
+    f->end = f->buf + st.st_size;
+    f->pos = st.st_size;
+    f->eof = EOF;
+    f->mapped = true;
+    f->shared = false;
+    f->row = 1;
+    f->column = 0;
+    f->lastc = 0;
+    return f;
+}
+#endif
+
 /* Open a file from filename and mode, creates a buffer.
  this buffer is used to store and read file data. */
 MYFILE * myfopen(const char *filename, const char *mode)
 {
+#if (HAVE_MMAP)
+    if (strpbrk(mode, "wa+")==NULL){
+        MYFILE *mf = mapfile(filename);
+        if (mf!=NULL)
+            return mf;
+    }
+#endif
     MYFILE *f = (MYFILE*) malloc2(sizeof(MYFILE));
 
     f->f = fopen(filename, mode);
@@ -67,6 +139,8 @@ MYFILE * myfopen(const char *filename, const char *mode)
     f->ptr = f->end = f->buf;// this indicates we have not read buffer
     f->pos = 0;
     f->eof = 0;
+    f->mapped = false;
+    f->shared = false;
     return f;
 }
 
@@ -74,7 +148,14 @@ MYFILE * myfopen(const char *filename, const char *mode)
 int myfclose(MYFILE *stream)
 {
     int ret = stream->f ? fclose(stream->f) : 0;
-    free(stream->buf);
+    if (not stream->shared){// shared buffer is freed when original stream is closed
+#if (HAVE_MMAP)
+        if (stream->mapped)
+            munmap(stream->buf, stream->end - stream->buf);
+        else
+#endif
+        free(stream->buf);
+    }
     free(stream);
     if (ret==EOF){
         return -1;
@@ -82,7 +163,7 @@ int myfclose(MYFILE *stream)
     return 0;
 }
 
-int myfseek(MYFILE *stream, long offset, int origin)
+int myfseek(MYFILE *stream, off_t offset, int origin)
 {
     if (stream->f==NULL)
     {
@@ -102,9 +183,9 @@ int myfseek(MYFILE *stream, long offset, int origin)
         }
         return 0;
     }
-    stream->eof = fseek(stream->f, offset, origin);
+    stream->eof = fseeko(stream->f, offset, origin);
     if (stream->eof==0) {
-        stream->pos = ftell(stream->f);
+        stream->pos = ftello(stream->f);
         stream->ptr = stream->end = stream->buf;
         return 0;
     }
@@ -136,26 +217,21 @@ size_t myfread (void *where, size_t size, size_t nmemb, MYFILE *stream)
 {
     char *str = (char *) where;
     size_t read;
-    int c;
-    long pos = myftell(stream);
+    off_t pos = myftell(stream);
 
     if (stream->f != NULL){
         if (myfseek(stream, pos, SEEK_SET)==-1){
             message(FATAL,"seek error");
         }
         read = fread(where, size, nmemb, stream->f);
-        stream->pos = ftell(stream->f);
+        stream->pos = ftello(stream->f);
         stream->ptr = stream->end = stream->buf;
         return read;
     }
-    // if MYFILE was created from string
-    for (read=0; read<size*nmemb; ++read){
-        if ((c=mygetc(stream))==EOF){
-            return read/size;
-        }
-        *str = c;
-        ++str;
-    }
+    // if MYFILE was created from string or mapped file, whole data is in buffer
+    read = MIN(size*nmemb, (size_t)(stream->end - stream->ptr));
+    memcpy(str, stream->ptr, read);
+    stream->ptr += read;
     return read/size;
 }
 
@@ -213,3 +289,140 @@ bool file_exist (const char *name)
     fclose(f);
     return true;
 }
+
+
+// *********** ------------- Output File ----------------- ***********
+
+OutFile:: OutFile(FILE *file)
+{
+    f = file;
+    buf = (char*) malloc2(OUT_BUFSIZE);
+    ptr = buf;
+    end = buf + OUT_BUFSIZE;
+    flushed = 0;
+#if (HAVE_WRITEV)
+    // data is written to file descriptor, so nothing must be left in FILE buffer
+    if (f!=NULL)
+        fflush(f);
+#endif
+}
+
+OutFile:: ~OutFile()
+{
+    if (f!=NULL)
+        flush();
+    free(buf);
+}
+
+// write data to file, and exits program on failure
+void OutFile:: writeFile(const void *data, size_t len)
+{
+    if (ptr==buf && len==0)
+        return;
+#if (HAVE_WRITEV)
+    // buffered data and given data are written in single system call
+    struct iovec iov[2] = {{buf, (size_t)(ptr-buf)}, {(void*)data, len}};
+    struct iovec *vec = iov;
+    int count = 2;
+    while (count) {
+        ssize_t n = writev(fileno(f), vec, count);
+        if (n<0 && errno==EINTR)
+            continue;
+        if (n<=0)
+            message(FATAL, "failed to write output file");
+        flushed += n;
+        // skip written data (for partial write)
+        while (count && (size_t)n >= vec->iov_len) {
+            n -= vec->iov_len;
+            vec++;
+            count--;
+        }
+        if (count) {
+            vec->iov_base = (char*)vec->iov_base + n;
+            vec->iov_len -= n;
+        }
+    }
+#else
+    size_t buf_len = ptr-buf;
+    if (fwrite(buf, 1, buf_len, f)!=buf_len || fwrite(data, 1, len, f)!=len)
+        message(FATAL, "failed to write output file");
+    flushed += buf_len + len;
+#endif
+    ptr = buf;
+}
+
+void OutFile:: flush()
+{
+    if (f==NULL)
+        return;
+    writeFile(NULL, 0);
+#if (!HAVE_WRITEV)
+    fflush(f);
+#endif
+}
+
+// make room for len bytes in buffer
+void OutFile:: makeRoom(size_t len)
+{
+    if (f!=NULL)
+        flush();
+    size_t size = end-buf, used = ptr-buf;
+    if (size-used >= len)
+        return;
+    // in memory mode (or for very large data), grow the buffer
+    while (size-used < len)
+        size *= 2;
+    char *new_buf = (char*) realloc(buf, size);
+    if (new_buf==NULL)
+        message(FATAL, "OutFile : realloc() failed !");
+    buf = new_buf;
+    ptr = buf + used;
+    end = buf + size;
+}
+
+void OutFile:: write(const void *data, size_t len)
+{
+    if (len > (size_t)(end-ptr)) {
+        if (f!=NULL && len >= OUT_DIRECT_LEN) {
+            writeFile(data, len);
+            return;
+        }
+        makeRoom(len);
+    }
+    memcpy(ptr, data, len);
+    ptr += len;
+}
+
+void OutFile:: putInt(int64_t val)
+{
+    if (end-ptr < 24)
+        makeRoom(24);
+    ptr += int2str(val, ptr);
+}
+
+void OutFile:: putReal(double val)
+{
+    if (end-ptr < 32)
+        makeRoom(32);
+    int len = real2str(val, ptr);
+    if (len>=0)
+        ptr += len;
+    else
+        putStr(double2str(val).c_str());
+}
+
+void OutFile:: print(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(ptr, end-ptr, format, args);
+    va_end(args);
+    if (len >= end-ptr) {
+        makeRoom(len+1);
+        va_start(args, format);
+        vsnprintf(ptr, end-ptr, format, args);
+        va_end(args);
+    }
+    if (len>0)
+        ptr += len;
+}
@@ -2,14 +2,19 @@
 /* This file is a part of pdfcook program, which is GNU GPLv2 licensed */
 #include <cstdio>
 #include <cctype> // toupper() isspace() etc
+#include <cstring>
+#include <cstdint>
+#include <sys/types.h> // off_t
 
 typedef struct {
     FILE *f;
     unsigned char *buf;// must be unsigned, otherwise char 255 becomes -1 (i.e EOF)
     unsigned char *ptr;
     unsigned char *end;
-    long pos;// offset of *end from the beginning file/string
+    off_t pos;// offset of *end from the beginning file/string
     int eof;// eof==EOF if no data left to read from file to internal buffer
+    bool mapped;// buf is a read-only memory map of the whole file
+    bool shared;// buf belongs to another MYFILE, so it is not freed on close
     // used in command parsing
     int column;
     int row;
@@ -26,13 +31,14 @@ typedef struct {
 #define myungetc(f) (f->ptr = ((f->ptr)>(f->buf)) ? (f->ptr-1) : (f->buf))
 
 
-// open a file stream by given filename
+// open a file stream by given filename. In read-only mode the whole file is
+// memory mapped (if possible), then it behaves like a stream created by streamopen()
 MYFILE * myfopen(const char * filename, const char *mode);
 // close a stream
 int myfclose(MYFILE *stream);
 
 // returns 0 on success and -1 on failure
-int myfseek(MYFILE *stream, long offset, int origin);
+int myfseek(MYFILE *stream, off_t offset, int origin);
 
 // read size*nmemb bytes from *stream and put data in *where
 size_t myfread(void *where, size_t size, size_t nmemb, MYFILE *stream);
@@ -47,6 +53,10 @@ int slow_mygetc(MYFILE * f);
 MYFILE * stropen(const char *str);
 // create a MYFILE any stream with given len
 MYFILE * streamopen(const char *str, size_t len);
+// create another MYFILE with own seek pos, which reads from the buffer of a
+// mapped file or string. returns NULL if whole data of stream is not in memory.
+// the new MYFILE must be closed before the original one.
+MYFILE * myfdup(MYFILE *stream);
 
 inline void skipspace(MYFILE *f) {
     int c;
@@ -56,3 +66,37 @@ inline void skipspace(MYFILE *f) {
 }
 
 bool file_exist (const char *name);
+
+
+/* Buffered writer for output file. Data is collected in a large buffer, and is
+ written when the buffer is full. Large blocks of data (eg. stream data) are written
+ directly from their memory without copying into the buffer.
+ If file is NULL, all data is kept in memory, which can be accessed by data() */
+class OutFile
+{
+public:
+    OutFile(FILE *f);
+    ~OutFile();
+    // number of bytes written so far, i.e current offset in file
+    off_t tell() { return flushed + (ptr-buf); }
+    void putChar(char c) {
+        if (ptr==end)
+            makeRoom(1);
+        *ptr++ = c;
+    }
+    void putStr(const char *str) { write(str, strlen(str)); }
+    void putInt(int64_t val);
+    void putReal(double val);// like %f but strips trailing zeros
+    void print(const char *format, ...);// printf() like formatted output
+    void write(const void *data, size_t len);
+    void flush();
+    char* data() { return buf; }// all data written to memory (if file is NULL)
+private:
+    FILE *f;
+    char *buf;
+    char *ptr;
+    char *end;
+    off_t flushed;// number of bytes written to file
+    void makeRoom(size_t len);
+    void writeFile(const void *data, size_t len);
+};
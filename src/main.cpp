@@ -21,17 +21,29 @@
 #include "doc_edit.h"
 #include "cmd_exec.h"
 #include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
 #include <getopt.h>
 
 /* when no commands are provided, no used pdf objects are removed, dict filters not applied.
   As new single Xref table created, so /Prev entry is removed from trailer dict. */
 bool repair_mode = false;
+// number of threads used to load objects. 0 means number of cpu cores
+int num_threads = 0;
+// write objects in object streams and xref table as xref stream
+bool objstm_mode = false;
+// zlib compression level (0-9) for output streams. -1 means default, 0 means no compression
+int compress_level = -1;
 
 
 char pusage[][LLEN] = {
     "Usage: pdfcook [<options>] [<commands>] <infile> ... <outfile>",
     "  -h   Display this help screen",
     "  -q --quiet   Supress warning and log messages",
+    "  -j --jobs=N  Number of threads used to read input files and edit pages",
+    "     --objstm  Compress objects in object streams (PDF 1.5)",
+    "     --compress-level=N  Compression level (1-9) of new streams, 0 for no compression",
     "     --fonts   Show available standard font names",
     "  -p --papers  Show available paper sizes",
     "commands: '<cmd1> <cmd2> ... <cmd_n>'",
@@ -51,11 +63,14 @@ static void print_help (FILE * stream, int exit_code)
     exit(exit_code);
 }
 // if an option requires argument, put a colon (:) after it in shortoptions
-static const char *short_options = "hqfp";
+static const char *short_options = "hqj:fp";
 // here, in 4th column, any integer can be used instead
 static struct option long_options[] = {
     {"help", no_argument, 0, 'h'},
     {"quiet", no_argument, 0, 'q'},
+    {"jobs", required_argument, 0, 'j'},
+    {"objstm", no_argument, 0, 'o'},
+    {"compress-level", required_argument, 0, 'l'},
     {"fonts", no_argument, 0, 'f'},
     {"papers", no_argument, 0, 'p'},
     {NULL, 0, 0, 0}
@@ -67,6 +82,17 @@ typedef struct {
     char  *commands;
 } Conf;
 
+// parse whole string as decimal integer, returns false if it is not an integer
+static bool parse_int(const char *str, int *val)
+{
+    char *end;
+    errno = 0;
+    long num = strtol(str, &end, 10);
+    if (end==str || *end!=0 || errno!=0 || num<INT_MIN || num>INT_MAX)
+        return false;
+    *val = num;
+    return true;
+}
 
 static void parseargs (int argc, char *argv[], Conf * conf)
 {
@@ -84,6 +110,17 @@ static void parseargs (int argc, char *argv[], Conf * conf)
         case 'q':
             quiet_mode = 1;
             break;
+        case 'j':
+            if (not parse_int(optarg, &num_threads) || num_threads<1)
+                message(FATAL, "number of jobs must be a positive integer");
+            break;
+        case 'o':
+            objstm_mode = true;
+            break;
+        case 'l':
+            if (not parse_int(optarg, &compress_level) || compress_level<0 || compress_level>9)
+                message(FATAL, "compress level must be an integer between 0 and 9");
+            break;
         case 'f':
             print_font_names();
             exit(1);
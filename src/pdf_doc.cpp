@@ -1,16 +1,18 @@
 /* This file is a part of pdfcook program, which is GNU GPLv2 licensed */
 #include "common.h"
 #include "pdf_doc.h"
+#include "pdf_filters.h"
 #include "debug.h"
 #include <set>
+#include <map>
 
 static void updateRefs(PdfDocument &doc);
 static void deleteUnusedObjects(PdfDocument &doc);
 
-static DictFilter trailer_filter({ "Size", "Root", "ID"});
-static DictFilter catalog_filter({ "Pages", "Type"});
-static DictFilter page_filter({ "Type", "Parent", "Resources", "Contents" });
-static DictFilter xobject_filter({ "Type", "Subtype", "FormType", "BBox", "Resources", "Length", "Filter"});
+static DictFilter trailer_filter({ NAME_Size, NAME_Root, NAME_ID});
+static DictFilter catalog_filter({ NAME_Pages, NAME_Type});
+static DictFilter page_filter({ NAME_Type, NAME_Parent, NAME_Resources, NAME_Contents });
+static DictFilter xobject_filter({ NAME_Type, NAME_Subtype, NAME_FormType, NAME_BBox, NAME_Resources, NAME_Length, NAME_Filter});
 
 // These standard 14 font names are supported by all PDF viewers
 static std::set<std::string> standard_fonts({
@@ -31,9 +33,30 @@ void print_font_names()
 void PageList:: append(PdfPage &page) {
     array.push_back(page);
 }
-void PageList:: remove(int index)
+// order of the pages which are kept does not change
+void PageList:: filter(std::vector<bool> &keep)
 {
-    array.erase(array.begin()+index);
+    assert(keep.size()==array.size());
+    size_t count = 0;
+    for (size_t i=0; i<array.size(); i++) {
+        if (keep[i])
+            array[count++] = array[i];
+    }
+    array.resize(count);
+}
+
+// returns false (and list is not changed) if any index is out of range
+bool PageList:: gather(std::vector<int> &indexes)
+{
+    std::vector<PdfPage> new_array;
+    new_array.reserve(indexes.size());
+    for (int index : indexes) {
+        if (index<0 || index>=(int)array.size())
+            return false;
+        new_array.push_back(array[index]);
+    }
+    array.swap(new_array);
+    return true;
 }
 void PageList:: clear()
 {
@@ -53,6 +76,7 @@ PageIter PageList:: end() {
 
 PdfDocument:: PdfDocument()
 {
+    ArenaScope scope(&obj_table.arena);
     trailer = new PdfObject();
     trailer->setType(PDF_OBJ_DICT);
     // set default paper size
@@ -63,17 +87,14 @@ PdfDocument:: PdfDocument()
     decryption_supported = false;
 }
 
+// objects are freed with the arena of object table
 PdfDocument:: ~PdfDocument()
 {
     page_list.clear();
-    int count = obj_table.count();
-    for (int i=0; i<count; i++) {
-        PdfObject *obj = obj_table[i].obj;
-        if (obj!=NULL)
-            delete obj;
-    }
     obj_table.table.clear();
-    delete trailer;
+    for (MYFILE *f : input_files) {
+        myfclose(f);
+    }
 }
 
 // Read pdf header and get version (major and minor)
@@ -101,7 +122,7 @@ bool PdfDocument:: getPdfHeader (MYFILE *f, char *line)
     return true;
 }
 
-bool PdfDocument:: getPdfTrailer (MYFILE *f, char *line, long offset)
+bool PdfDocument:: getPdfTrailer (MYFILE *f, char *line, off_t offset)
 {
     // read from end of file and find last xref offset
     if (offset==-1){
@@ -127,7 +148,7 @@ bool PdfDocument:: getPdfTrailer (MYFILE *f, char *line, long offset)
             return false;
         }
         for (p = buff+i+9; isspace(*p); p++);
-        offset = atol(p);
+        offset = strtoll(p, NULL, 10);
     }
     myfseek(f, offset, SEEK_SET);
 
@@ -142,7 +163,7 @@ bool PdfDocument:: getPdfTrailer (MYFILE *f, char *line, long offset)
             message(FATAL,"xreftable read error");
         }
         // skip trailer keyword
-        long fpos;
+        off_t fpos;
         do {
             fpos = myftell(f);
             if (myfgets(line,LLEN,f)==NULL){
@@ -157,14 +178,15 @@ bool PdfDocument:: getPdfTrailer (MYFILE *f, char *line, long offset)
     }
     // read trailer dictionary
     PdfObject content;
-    if (not content.read(f, NULL, NULL)) {
+    IndirectObj content_id;
+    if (not content.read(f, NULL, &content_id)) {
         message(FATAL, "Unable to read trailer object");
     }
     PdfObject *p_trailer = new PdfObject();
 
-    if (content.type==PDF_OBJ_INDIRECT && content.indirect.obj->type==PDF_OBJ_STREAM){
+    if (content_id.major>=0 && content.type==PDF_OBJ_STREAM){
         p_trailer->setType(PDF_OBJ_DICT);
-        p_trailer->dict->merge(&content.indirect.obj->stream->dict);
+        p_trailer->dict->merge(&content.stream->dict);
     }
     else if (content.type==PDF_OBJ_DICT) {
         p_trailer->copyFrom(&content);
@@ -175,18 +197,18 @@ bool PdfDocument:: getPdfTrailer (MYFILE *f, char *line, long offset)
         return false;
     }
     if (xref_type==XREF_STREAM) {
-        if (not obj_table.read(content.indirect.obj, p_trailer)){
+        if (not obj_table.read(&content, p_trailer)){
             message(FATAL,"xreftable read error");
             return false;
         }
     }
-    if (p_trailer->dict->contains("Encrypt")){
+    if (p_trailer->dict->contains(NAME_Encrypt)){
         if (xref_type==XREF_STREAM){
             message(FATAL, "Can not handle encrypted PDF with Xref stream");
         }
         if (!have_encrypt_info) {
             encrypted = true;
-            PdfObject *encrypt_dict = p_trailer->dict->get("Encrypt");
+            PdfObject *encrypt_dict = p_trailer->dict->get(NAME_Encrypt);
 
             if (isRef(encrypt_dict)){
                 if (not obj_table.readObject(f, encrypt_dict->indirect.major))
@@ -200,9 +222,9 @@ bool PdfDocument:: getPdfTrailer (MYFILE *f, char *line, long offset)
                 decryption_supported = crypt.decryptionSupported();
             }
         }
-        p_trailer->dict->deleteItem("Encrypt");
+        p_trailer->dict->deleteItem(NAME_Encrypt);
     }
-    PdfObject *prev = p_trailer->dict->get("Prev");
+    PdfObject *prev = p_trailer->dict->get(NAME_Prev);
     if (prev){
         if (prev->type!=PDF_OBJ_INT){
             message(FATAL,"Object in dict of trailer Prev is not int");
@@ -211,7 +233,7 @@ bool PdfDocument:: getPdfTrailer (MYFILE *f, char *line, long offset)
         if (not getPdfTrailer(f, line, prev->integer)){
             return false;
         } // this->trailer = Prev trailer, p_trailer = current trailer
-        p_trailer->dict->deleteItem("Prev");
+        p_trailer->dict->deleteItem(NAME_Prev);
     }
     if (not repair_mode)
         p_trailer->dict->filter(trailer_filter);
@@ -222,7 +244,7 @@ bool PdfDocument:: getPdfTrailer (MYFILE *f, char *line, long offset)
 
 bool PdfDocument:: getAllPages(MYFILE *f)
 {
-    PdfObject *pobj = trailer->dict->get("Root");//get Catalog
+    PdfObject *pobj = trailer->dict->get(NAME_Root);//get Catalog
 
     if (not isRef(pobj)) {
         message(FATAL,"Trailer dictionary doesn't contain Root entry");
@@ -230,7 +252,7 @@ bool PdfDocument:: getAllPages(MYFILE *f)
     pobj = obj_table.getObject(pobj->indirect.major, pobj->indirect.minor);
     if (not repair_mode)
         pobj->dict->filter(catalog_filter);
-    pobj = pobj->dict->get("Pages");
+    pobj = pobj->dict->get(NAME_Pages);
     if (not isRef(pobj)){
         message(FATAL,"Catalog dictionary dosn't contain Pages entry");
     }
@@ -249,16 +271,18 @@ bool PdfDocument:: open (const char *fname)
     if ((f=myfopen(fname, "rb"))==NULL){
         return false;
     }
+    ArenaScope scope(&obj_table.arena);
+    // file is closed when document is deleted
+    input_files.push_back(f);
+    obj_table.file = f;
     filename = fname;
     if (not getPdfHeader(f,iobuffer)){
         message(ERROR, "failed to read PDF header");
-        myfclose(f);
         return false;
     }
     message(LOG, fname);
     if (not getPdfTrailer(f,iobuffer,-1)){
         message(ERROR, "failed to read PDF trailer");
-        myfclose(f);
         return false;
     }
     if (encrypted){
@@ -268,9 +292,11 @@ bool PdfDocument:: open (const char *fname)
         }
         return false;
     }
-    obj_table.readObjects(f);
+    // objects are loaded from file when required. but when whole document is
+    // rewritten, almost all objects are needed, so load them all at once in parallel.
+    if (repair_mode)
+        obj_table.readObjects(f);
     getAllPages(f);
-    myfclose(f);
 
     debug("    Version : %d.%d", v_major, v_minor);
     debug("    Objects : %d", obj_table.table.size());
@@ -280,14 +306,15 @@ bool PdfDocument:: open (const char *fname)
 
 bool PdfDocument:: decrypt(const char *password)
 {
-    MYFILE *f;
-    if ((f=myfopen(filename, "rb"))==NULL){
+    MYFILE *f = obj_table.file;
+    if (f==NULL){
         return false;
     }
     if (!decryption_supported){
         message(ERROR, "decryption is not supported for this PDF");
         return false;
     }
+    ArenaScope scope(&obj_table.arena);
     // if object table is loaded, decrypt all objects in object table
     if (not crypt.authenticate(password)){
         if (strlen(password)!=0)
@@ -303,36 +330,105 @@ bool PdfDocument:: decrypt(const char *password)
     }
     encrypted = false;
     getAllPages(f);
-    myfclose(f);
     debug("    Version : %d.%d", v_major, v_minor);
     debug("    Objects : %d", obj_table.table.size());
     message(LOG, "    Pages : %d", page_list.count());
     return true;
 }
 
+/* Move the direct object which is the value of key in dict to a new indirect object,
+ and put a reference to it in its place, so that other objects can refer to the same
+ object instead of copying it. returns the reference, or NULL if key is not found */
+static PdfObject* make_indirect (DictObj *dict, int key, ObjectTable &table)
+{
+    PdfObject *obj = dict->get(key);
+    if (obj==NULL || isRef(obj))
+        return obj;
+    PdfObject *new_obj = new PdfObject();
+    memcpy((void*)new_obj, (void*)obj, sizeof(PdfObject));// moved, not copied
+    obj->type = PDF_OBJ_INDIRECT_REF;
+    obj->indirect.major = table.addObject(new_obj);
+    obj->indirect.minor = table[obj->indirect.major].minor;
+    return obj;
+}
+
+/* Add the Resources inherited from parent dict to child dict. Like DictObj::merge(),
+ items of child have priority, and dicts present in both are merged. The dicts which
+ child does not have are moved to indirect objects and shared, instead of copying.
+ So dicts of both may be indirect, and are dereferenced before merging. */
+static void inherit_resources (DictObj *child, DictObj *parent, ObjectTable &table)
+{
+    for (auto it : *parent) {
+        PdfObject *val = child->get(it.first);
+        if (val==NULL){
+            if (it.second->type==PDF_OBJ_DICT)
+                make_indirect(parent, it.first, table);
+            child->newItem(it.first)->copyFrom(it.second);
+            continue;
+        }
+        PdfObject *parent_val = derefObject(it.second, table);
+        if (not isDict(parent_val))
+            continue;
+        if (isRef(val)){
+            PdfObject *child_val = derefObject(val, table);
+            if (not isDict(child_val))
+                continue;
+            // indirect dict may be used by other pages, so merge in a copy of it
+            val->copyFrom(child_val);
+        }
+        if (val->type==PDF_OBJ_DICT)
+            inherit_resources(val->dict, parent_val->dict, table);
+    }
+}
+
+/* Page tree is walked using a stack of nodes instead of recursion, so that
+  a long chain of Pages nodes can not overflow the call stack. */
 bool PdfDocument:: getPdfPages(MYFILE *f, int major, int minor)
 {
     PdfObject *pages, *pages_type, *kids, *child_pg;
-    PdfObject *resources, *child_resources;
+    PdfObject *resources, *resources_ref, *child_resources;
     PdfObject *mediabox, *cropbox;
-
+    // nodes are pushed in reverse order, so that pages are added in order
+    std::vector<std::pair<int,int> > nodes;
+    std::vector<bool> visited(obj_table.count(), false);// Pages nodes already read
+    // merged Resources object of each (parent Resources, child Resources) pair of objects
+    std::map<std::pair<PdfObject*,PdfObject*>, int> merged_resources;
+    nodes.push_back(std::make_pair(major, minor));
+
+    while (not nodes.empty()) {
+    major = nodes.back().first;
+    minor = nodes.back().second;
+    nodes.pop_back();
     pages = obj_table.getObject(major, minor);
-    pages_type = pages->dict->get("Type");
+    if (not isDict(pages)){
+        message(FATAL,"Pages or Page object is not a dictionary");
+    }
+    pages_type = pages->dict->get(NAME_Type);
     if (not isName(pages_type)){
         message(FATAL,"Pages or Page dictionary dosn't contain /Type entry");
     }
     /*Pages node*/
-    if (strcmp("Pages", pages_type->name)==0){
+    if (pages_type->name==NAME_Pages){
+        if (visited[major]){
+            message(WARN, "Pages node %d is a child of itself", major);
+            continue;
+        }
+        visited[major] = true;
         // get paper size and cropbox
-        mediabox = pages->dict->get("MediaBox");
-        cropbox = pages->dict->get("CropBox");
+        mediabox = pages->dict->get(NAME_MediaBox);
+        cropbox = pages->dict->get(NAME_CropBox);
         // get all childs, each child may be a Pages Node, or a Page Object
-        kids = derefObject(pages->dict->get("Kids"), obj_table);
+        kids = derefObject(pages->dict->get(NAME_Kids), obj_table);
 
         if (not isArray(kids)){
             message(FATAL,"Pages dictionary doesn't contain /Kids entry");
         }
-        resources = derefObject(pages->dict->get("Resources"), obj_table);
+        resources = derefObject(pages->dict->get(NAME_Resources), obj_table);
+        // child pages refer to Resources of this node, instead of having a copy
+        resources_ref = isDict(resources) ? make_indirect(pages->dict, NAME_Resources, obj_table) : NULL;
+        // a direct Resources dict has been moved to the new indirect object
+        if (resources_ref!=NULL)
+            resources = derefObject(resources_ref, obj_table);
 
         for (auto kid=kids->array->begin(); kid!=kids->array->end(); kid++)
         {
@@ -340,38 +436,55 @@ bool PdfDocument:: getPdfPages(MYFILE *f, int major, int minor)
                 message(FATAL,"Kids array item is not indirect ref object");
             }
             child_pg = obj_table.getObject((*kid)->indirect.major, (*kid)->indirect.minor);
+            if (not isDict(child_pg)){
+                message(FATAL,"Pages or Page object is not a dictionary");
+            }
             // copy MediaBox and CropBox of Pages Node to child node
-            if (mediabox and child_pg->dict->get("MediaBox")==NULL){
-                child_pg->dict->newItem("MediaBox")->copyFrom(mediabox);
+            if (mediabox and child_pg->dict->get(NAME_MediaBox)==NULL){
+                child_pg->dict->newItem(NAME_MediaBox)->copyFrom(mediabox);
             }
-            if (cropbox and child_pg->dict->get("CropBox")==NULL){
-                child_pg->dict->newItem("CropBox")->copyFrom(cropbox);
+            if (cropbox and child_pg->dict->get(NAME_CropBox)==NULL){
+                child_pg->dict->newItem(NAME_CropBox)->copyFrom(cropbox);
             }
             // add resources of Pages Node to child page Resources
             if (isDict(resources)){
                 // child has Resources entry, merge with parent's Resources Dict
-                if ((child_resources = child_pg->dict->get("Resources"))!=NULL){
+                if ((child_resources = child_pg->dict->get(NAME_Resources))!=NULL){
                     child_resources = derefObject(child_resources, obj_table);
                     assert(child_resources->type==PDF_OBJ_DICT);
                     // both resources may be same indirect obj, no need to merge then
-                    if (resources != child_resources){
+                    if (resources == child_resources)
+                        continue;
+                    PdfObject *res = child_pg->dict->get(NAME_Resources);
+                    if (not isRef(res)){// direct Resources is not shared by other pages
+                        inherit_resources(child_resources->dict, resources->dict, obj_table);
+                        continue;
+                    }
+                    // many pages may have same Resources object, merge only once for them
+                    auto key = std::make_pair(resources, child_resources);
+                    auto it = merged_resources.find(key);
+                    if (it == merged_resources.end()){
                         PdfObject *new_res = new PdfObject();
-                        new_res->copyFrom(resources);
-                        new_res->dict->merge(child_resources->dict);
-                        child_pg->dict->deleteItem("Resources");
-                        child_pg->dict->add("Resources", new_res);
+                        new_res->copyFrom(child_resources);
+                        inherit_resources(new_res->dict, resources->dict, obj_table);
+                        it = merged_resources.insert(std::make_pair(key, obj_table.addObject(new_res))).first;
                     }
+                    res->indirect.major = it->second;
+                    res->indirect.minor = obj_table[it->second].minor;
                 }
-                else {// child doesn't have Resources entry, copy all Resources from parent
-                    child_pg->dict->newItem("Resources")->copyFrom(resources);
+                else {// child doesn't have Resources entry, use Resources of parent
+                    child_pg->dict->newItem(NAME_Resources)->copyFrom(resources_ref);
                 }
             }
-            getPdfPages(f, (*kid)->indirect.major, (*kid)->indirect.minor);
         }
-        return true;
+        for (int i=kids->array->count()-1; i>=0; i--){
+            PdfObject *kid = kids->array->at(i);
+            nodes.push_back(std::make_pair(kid->indirect.major, kid->indirect.minor));
+        }
+        continue;
     }
     /*Page leaf*/
-    if (strcmp("Page", pages_type->name)==0){
+    if (pages_type->name==NAME_Page){
         PdfPage new_page;
         /* Page Boundaries are very confusing. There are 4 types of Boundaries
            MediaBox = Paper Size on which page is printed
@@ -381,12 +494,12 @@ bool PdfDocument:: getPdfPages(MYFILE *f, int major, int minor)
            TrimBox = Same as CropBox When FitToPage is on in printer, otherwise no effect.
            BleedBox and ArtBpx has no effect either in printer or in viewer
         */
-        if (!new_page.paper.getFromObject(pages->dict->get("MediaBox"), obj_table)) {
+        if (!new_page.paper.getFromObject(pages->dict->get(NAME_MediaBox), obj_table)) {
             message(FATAL, "Page does not have MediaBox entry");
         }
         // in a pdfviewer, the visible page size is the CropBox
         Rect cropbox;
-        if (cropbox.getFromObject(pages->dict->get("CropBox"), obj_table)){
+        if (cropbox.getFromObject(pages->dict->get(NAME_CropBox), obj_table)){
             new_page.paper = cropbox;
         }
         if (not repair_mode)
@@ -395,10 +508,12 @@ bool PdfDocument:: getPdfPages(MYFILE *f, int major, int minor)
         new_page.minor = minor;
         new_page.doc = this;
         page_list.append(new_page);
-        return true;
+        continue;
     }
     message(FATAL,"PdfDocument::getPdfPages : Object isn't Page or Pages");
     return false;
+    }
+    return true;
 }
 
 #define NODE_MAX 50
@@ -420,7 +535,7 @@ static int makePagesTree(int *nodes, int pages_count, ObjectTable &obj_table)
         node = new PdfObject();
         node->readFromString("<< /Type /Pages /Count 0 /Kids [ ]  /Parent 0 0 R >>");
         major = obj_table.addObject(node);
-        kids = node->dict->get("Kids");
+        kids = node->dict->get(NAME_Kids);
         count = 0;
         for (int j=0; j<NODE_MAX; ++j){
             int pg_num = i*NODE_MAX + j;//index of this child on nodes array
@@ -428,24 +543,23 @@ static int makePagesTree(int *nodes, int pages_count, ObjectTable &obj_table)
                 break;
             }
             page = obj_table[ nodes[pg_num] ].obj;// Page leaf or Pages Node
-            if (((pobj=page->dict->get("Count"))!=NULL) && isInt(pobj)){
+            if (((pobj=page->dict->get(NAME_Count))!=NULL) && isInt(pobj)){
                 count += pobj->integer;
             }
             else{
                 count++;
             }
-            pobj = page->dict->get("Parent");
+            pobj = page->dict->get(NAME_Parent);
             pobj->indirect.major = major;
             pobj->indirect.minor = obj_table[major].minor;
 
             // add the ref of Page obj to Kids array of Pages node
-            pobj = new PdfObject();
+            pobj = kids->array->newItem();
             pobj->setType(PDF_OBJ_INDIRECT_REF);
             pobj->indirect.major = nodes[pg_num];
             pobj->indirect.minor = obj_table[ nodes[pg_num] ].minor;
-            kids->array->append(pobj);
         }
-        count_obj = node->dict->get("Count");
+        count_obj = node->dict->get(NAME_Count);
         count_obj->integer = count;
         // add this node to nodes array, so this function can be run recursively
         nodes[i] = major;
@@ -455,7 +569,7 @@ static int makePagesTree(int *nodes, int pages_count, ObjectTable &obj_table)
     }
     if (nodes_count==1) {
         node = obj_table[ nodes[0] ].obj;
-        node->dict->deleteItem("Parent");
+        node->dict->deleteItem(NAME_Parent);
         return major;
     }
     return -1;//nodes_count==0
@@ -476,61 +590,115 @@ void PdfDocument:: putPdfPages()
         nodes[count] = page->major;
         pobj = obj_table.getObject(page->major, page->minor);
         // set paper size in Page Dict
-        page->paper.setToObject(pobj->dict->newItem("MediaBox"));
+        page->paper.setToObject(pobj->dict->newItem(NAME_MediaBox));
     }
     makePagesTree(nodes, count, obj_table);
 
     // get catalog object from trailer,
-    pobj = trailer->dict->get("Root");
+    pobj = trailer->dict->get(NAME_Root);
     pobj = obj_table[pobj->indirect.major].obj;
     // get Pages node obj from catalog
-    pobj = pobj->dict->get("Pages");
+    pobj = pobj->dict->get(NAME_Pages);
     // set reference of Pages Node to root of pages tree
     pobj->indirect.major = nodes[0];
     pobj->indirect.minor = obj_table[ nodes[0] ].minor;
     free(nodes);
 }
 
+/* Upper estimate of size of output file, to know before writing the header whether
+ offsets will fit in xref table. Stream data is counted exactly, and each object
+ is assumed to take at most 1KB besides its stream data. */
+static off_t output_size_estimate (ObjectTable &table)
+{
+    off_t size = 0;
+    for (size_t i=1; i<table.table.size(); ++i){
+        ObjectTableItem &item = table.table[i];
+        if (item.type!=NONFREE_OBJ || item.obj==NULL)
+            continue;
+        size += 1024;
+        if (item.obj->type==PDF_OBJ_STREAM)
+            size += item.obj->stream->len;
+    }
+    return size;
+}
+
 bool PdfDocument:: save (const char *filename)
 {
     PdfObject *pobj;
-    FILE *f = stdout;
+    FILE *fp = stdout;
 
     if (strcmp(filename,"-")!=0){
-        f = fopen(filename,"wb");
-        if (f==NULL){
+        fp = fopen(filename,"wb");
+        if (fp==NULL){
             message(ERROR, "Cannot open for writing file '%s'",filename);
             return false;
         }
     }
-    // write header
-    fprintf(f, "%%PDF-%d.%d\n", v_major, v_minor);
-    // second line of file should contain at least 4 non-ASCII characters in
-    char binary[] = {(char)0xDE,(char)0xAD,' ',(char)0xBE,(char)0xEF,'\n',0};
-    fprintf(f, "%s", binary);
+    ArenaScope scope(&obj_table.arena);
     // build Pages tree, and insert root Pages node in Catalog
     applyTransformations();// apply transformation matrix of all pages
     putPdfPages();
     deleteUnusedObjects(*this);//remove unused objects from object table
+    if (objstm_mode)
+        obj_table.packObjects();
+    // offsets of 10GB or more do not fit in 10 digit field of xref table
+    bool xref_stream = objstm_mode || output_size_estimate(obj_table) > XREF_MAX_OFFSET;
+    // object streams and xref stream require PDF 1.5
+    if (xref_stream && v_major==1 && v_minor<5)
+        v_minor = 5;
+    OutFile *f = new OutFile(fp);
+    // write header
+    f->print("%%PDF-%d.%d\n", v_major, v_minor);
+    // second line of file should contain at least 4 non-ASCII characters in
+    char binary[] = {(char)0xDE,(char)0xAD,' ',(char)0xBE,(char)0xEF,'\n',0};
+    f->putStr(binary);
     obj_table.writeObjects(f);
     // write cross reference table
-    long xref_poz = ftell(f);
-    obj_table.writeXref(f);
-    // write trailer dictionary
-    fprintf(f, "trailer\n");
-    pobj = trailer->dict->get("Size");
-    pobj->integer = obj_table.count();
-    trailer->write(f);
+    off_t xref_poz = f->tell();
+    if (!xref_stream && xref_poz > XREF_MAX_OFFSET) {
+        message(WARN, "output is larger than estimated, using xref stream in PDF-%d.%d file", v_major, v_minor);
+        xref_stream = true;
+    }
+    if (xref_stream) {
+        // trailer dict is written in xref stream dict
+        obj_table.writeXrefStream(f, trailer);
+    }
+    else {
+        obj_table.writeXref(f);
+        // write trailer dictionary
+        f->putStr("trailer\n");
+        pobj = trailer->dict->get(NAME_Size);
+        pobj->integer = obj_table.count();
+        trailer->write(f);
+    }
     // startxref, xref offset, and %%EOF must be in three separate lines
-    fprintf(f, "\nstartxref\n%ld\n%%%%EOF\n", xref_poz);
-    fclose(f);
+    f->print("\nstartxref\n%lld\n%%%%EOF\n", (long long)xref_poz);
+    delete f;// flushes data
+    fclose(fp);
     return true;
 }
 
+static void flag_used_objects (PdfObject *obj, ObjectTable &table);
+
 // insert parameter doc structure into current doc structure
 void
 PdfDocument:: mergeDocument(PdfDocument &doc)
 {
+    // load the objects of doc that are used, as doc's object table is going to be discarded.
+    // objects which are not loaded are not required, so treat them as free.
+    for (int i=0; i<doc.obj_table.count(); ++i){
+        doc.obj_table[i].used = false;
+    }
+    flag_used_objects(doc.trailer, doc.obj_table);
+    for (auto &page : doc.page_list) {
+        PdfObject *page_obj = doc.obj_table.getObject(page.major, page.minor);
+        if (page_obj!=NULL)
+            flag_used_objects(page_obj, doc.obj_table);
+    }
+    for (int i=1; i<doc.obj_table.count(); ++i){
+        if (doc.obj_table[i].obj==NULL)
+            doc.obj_table[i].type = FREE_OBJ;
+    }
     int offset = obj_table.count();
     // new obj_table size is one less than size of the two tables.
     // because, we dont need to copy first item of the second obj_table.
@@ -551,6 +719,11 @@ PdfDocument:: mergeDocument(PdfDocument &doc)
         obj_table[item.major] = item;
     }
     doc.obj_table.table.clear();
+    // stream objects of doc may read data from its input files
+    input_files.insert(input_files.end(), doc.input_files.begin(), doc.input_files.end());
+    doc.input_files.clear();
+    // objects of doc are now owned by this document
+    obj_table.arena.adopt(doc.obj_table.arena);
 }
 
 
@@ -558,79 +731,34 @@ PdfDocument:: mergeDocument(PdfDocument &doc)
 // flag 1 objects will not be deleted during write
 static void flag_used_objects (PdfObject *obj, ObjectTable &table)
 {
-    switch (obj->type){
-        case PDF_OBJ_BOOL:
-        case PDF_OBJ_INT:
-        case PDF_OBJ_REAL:
-        case PDF_OBJ_STR:
-        case PDF_OBJ_NAME:
-        case PDF_OBJ_NULL:
-            return;
-        case PDF_OBJ_ARRAY:
-            for (auto it : *obj->array) {
-                flag_used_objects(it, table);
-            }
-            return;
-        case PDF_OBJ_DICT:
-            for (auto it : *obj->dict){
-                flag_used_objects(it.second, table);
-            }
-            return;
-        case PDF_OBJ_STREAM:
-            for (auto it : obj->stream->dict){
-                flag_used_objects(it.second, table);
-            }
-            return;
-        case PDF_OBJ_INDIRECT_REF:
-            if (table[obj->indirect.major].used){
-                return;
-            }
-            if (table[obj->indirect.major].obj==NULL){
-                // in some bad pdfs even if the object is free, the object is referenced
-                debug("warning : referencing free obj : %d %d R", obj->indirect.major, obj->indirect.minor);
-                obj->type = PDF_OBJ_NULL;
-                return;
-            }
-            table[obj->indirect.major].used = true;
-            flag_used_objects(table[obj->indirect.major].obj, table);
-            return;
-        default:
-            assert(0);
+    ObjectWalker walker(obj);
+    while ((obj = walker.next()) != NULL) {
+        if (obj->type!=PDF_OBJ_INDIRECT_REF){
+            continue;
+        }
+        if (table.getObject(obj->indirect.major)==NULL){
+            // in some bad pdfs even if the object is free, the object is referenced
+            debug("warning : referencing free obj : %d %d R", obj->indirect.major, obj->indirect.minor);
+            obj->type = PDF_OBJ_NULL;
+            continue;
+        }
+        if (table[obj->indirect.major].used){
+            continue;
+        }
+        table[obj->indirect.major].used = true;
+        walker.push(table[obj->indirect.major].obj);
     }
 }
 
 // Replace old references with new references of same object
 static void update_obj_ref(PdfObject *obj, ObjectTable &table)
 {
-    switch (obj->type){
-        case PDF_OBJ_BOOL:
-        case PDF_OBJ_INT:
-        case PDF_OBJ_REAL:
-        case PDF_OBJ_STR:
-        case PDF_OBJ_NAME:
-        case PDF_OBJ_NULL:
-            return;
-        case PDF_OBJ_ARRAY:
-            for (auto it : *obj->array) {
-                update_obj_ref(it, table);
-            }
-            return;
-        case PDF_OBJ_DICT:
-            for (auto it : *obj->dict){
-                update_obj_ref(it.second, table);
-            }
-            return;
-        case PDF_OBJ_STREAM:
-            for (auto it : obj->stream->dict){
-                update_obj_ref(it.second, table);
-            }
-            return;
-        case PDF_OBJ_INDIRECT_REF:
+    ObjectWalker walker(obj);
+    while ((obj = walker.next()) != NULL) {
+        if (obj->type==PDF_OBJ_INDIRECT_REF){
             obj->indirect.minor = table[obj->indirect.major].minor;
             obj->indirect.major = table[obj->indirect.major].major;
-            return;
-        default:
-            assert(0);
+        }
     }
 }
 
@@ -642,7 +770,7 @@ static void updateRefs(PdfDocument &doc)
     }
     update_obj_ref(doc.trailer, doc.obj_table);
     for (int i=1; i<doc.obj_table.count(); i++) {// obj 0 may be nonfree in bad pdfs, causing segfault
-        if (doc.obj_table[i].type) {
+        if (doc.obj_table[i].type && doc.obj_table[i].obj!=NULL) {
             update_obj_ref(doc.obj_table[i].obj, doc.obj_table);
         }
     }
@@ -701,17 +829,10 @@ PdfDocument:: applyTransformations()
 /********************* ------------------------- ***********************
                             Document Editing
 ________________________________________________________________________*/
-// if the page_num is -1, blank page is added at the end
-bool
-PdfDocument:: newBlankPage(int page_num)
+// create an empty page object, the returned page is not added to page list
+PdfPage
+PdfDocument:: newBlankPage(Rect &paper)
 {
-    if (page_num==-1) {
-        page_num = page_list.count()+1;
-    }
-    else if (page_num < 1 and page_num > (page_list.count()+1)) {
-        message(WARN, "newBlankPage() : invalid page num %d", page_num);
-        return false;
-    }
     PdfObject *page, *content;
 
     page = new PdfObject();
@@ -722,7 +843,7 @@ PdfDocument:: newBlankPage(int page_num)
     content->setType(PDF_OBJ_STREAM);
     int major = obj_table.addObject(content);
 
-    content = page->dict->newItem("Contents");
+    content = page->dict->newItem(NAME_Contents);
     content->setType(PDF_OBJ_INDIRECT_REF);
     content->indirect.major = major;
     content->indirect.minor = obj_table[major].minor;
@@ -733,19 +854,57 @@ PdfDocument:: newBlankPage(int page_num)
     p_page.minor = obj_table[major].minor;
     p_page.compressed = false;
     p_page.doc = this;
-    int ref_page_num = page_num;// if odd page and not last page, use next page size
-    // if new page is last page or page no. is even, use prev page size
-    if (page_num > page_list.count() or page_num%2==0)
-        ref_page_num = page_num-1;
-    // use the same cropbox and papersize as reference page
-    p_page.paper = page_list[ref_page_num-1].paper;
+    p_page.paper = paper;
+    return p_page;
+}
 
-    if (page_num > page_list.count()) {
-        page_list.append(p_page);
+// add blank pages at the end, with same paper size as the last page
+void
+PdfDocument:: appendBlankPages(int count)
+{
+    if (count<=0)
+        return;
+    Rect paper;
+    if (page_list.count()>0)
+        paper = page_list[page_list.count()-1].paper;
+    else // no page to copy size from, use A4 size
+        paper.right = Point(595, 842);
+    page_list.array.reserve(page_list.array.size() + count);
+    for (int i=0; i<count; i++) {
+        PdfPage page = newBlankPage(paper);
+        page_list.append(page);
     }
-    else {
-        page_list.array.emplace(page_list.array.begin()+(page_num-1), p_page);//c++11
+}
+
+/* insert a blank page at each of the sorted page numbers. Each page is inserted
+ at the page number in the list which contains the previously inserted pages.
+ An odd page (if it is not the last page) gets the paper size of next page,
+ otherwise the page gets paper size of previous page. */
+bool
+PdfDocument:: insertBlankPages(std::vector<int> &page_nums)
+{
+    std::vector<PdfPage> new_array;
+    new_array.reserve(page_list.array.size() + page_nums.size());
+    size_t next = 0;// index of next old page to be copied
+    for (int page_num : page_nums) {
+        int count = new_array.size() + (page_list.array.size()-next);// pages in list now
+        if (page_num < 1 or page_num > count+1 or (page_num==1 and count==0)) {
+            message(WARN, "insertBlankPages() : invalid page num %d", page_num);
+            return false;
+        }
+        // pages before page_num are already in new_array for duplicate page_nums
+        while ((int)new_array.size() < page_num-1)
+            new_array.push_back(page_list.array[next++]);
+        // if new page is last page or page no. is even, use prev page size,
+        // else use the size of the page currently at page_num
+        int ref_page_num = (page_num > count or page_num%2==0) ? page_num-1 : page_num;
+        Rect paper = ((int)new_array.size() >= ref_page_num) ? new_array[ref_page_num-1].paper
+                                                             : page_list.array[next].paper;
+        new_array.push_back(newBlankPage(paper));
     }
+    while (next < page_list.array.size())
+        new_array.push_back(page_list.array[next++]);
+    page_list.array.swap(new_array);
     return true;
 }
 
@@ -771,36 +930,6 @@ PdfDocument:: newFontObject(const char *font_name)
     return font;
 }
 
-static void pdf_stream_prepend(PdfObject *stream, const char *str, int len)
-{
-    if (len==0 or str==NULL)
-        return;
-    char *new_stream = (char*) malloc2(len + stream->stream->len);
-    memcpy(new_stream, str, len);
-    if (stream->stream->len!=0) {
-        memcpy(new_stream+len, stream->stream->stream, stream->stream->len);
-    }
-    if (stream->stream->stream){
-        free(stream->stream->stream);
-    }
-    stream->stream->stream = new_stream;
-    stream->stream->len += len;
-}
-
-// get a stream object and append a char stream to it
-static void pdf_stream_append(PdfObject *stream, const char *str, int len)
-{
-    if (len==0 or str==NULL)
-        return;
-    int old_len = stream->stream->len;
-    stream->stream->len += len;
-    stream->stream->stream = (char*) realloc(stream->stream->stream, stream->stream->len);
-    if (stream->stream->stream==NULL)
-        message(FATAL, "realloc() failed !");
-    char *ptr = stream->stream->stream + old_len;
-    memcpy(ptr, str, len);
-}
-
 /*
  takes a content stream obj and a page obj, creates a new xobject, then copy the
  content stream and resources of page to the xobject
@@ -822,23 +951,67 @@ stream_to_xobj (PdfObject *contents, PdfObject *page, Rect &bbox, ObjectTable &o
 
     tmp = new PdfObject;
     tmp->readFromString("<< /Type /XObject /Subtype /Form /FormType 1 >>");
-    bbox.setToObject(tmp->dict->newItem("BBox"));
+    bbox.setToObject(tmp->dict->newItem(NAME_BBox));
     xobj->stream->dict.merge(tmp->dict);
     delete tmp;
-    // copy page resources to xobject resources
-    pg_res = derefObject(page->dict->get("Resources"), obj_table);
+    // xobject refers to the page resources, instead of having a copy
+    pg_res = derefObject(page->dict->get(NAME_Resources), obj_table);
 
     if (pg_res!=NULL){
         assert(pg_res->type==PDF_OBJ_DICT);
-        xobj_res = xobj->stream->dict.newItem("Resources");
-        xobj_res->copyFrom(pg_res);
+        xobj_res = xobj->stream->dict.newItem(NAME_Resources);
+        xobj_res->copyFrom(make_indirect(page->dict, NAME_Resources, obj_table));
     }
     xobj->stream->dict.filter(xobject_filter);
     return obj_table.addObject(xobj);
 }
 
+// growing buffer, where content streams of a page are joined
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} JoinBuffer;
+
+// DataSink which appends data to JoinBuffer
+static bool join_buffer_add (const char *data, size_t len, void *buffer)
+{
+    JoinBuffer *buf = (JoinBuffer*) buffer;
+    if (len==0)
+        return true;
+    if (buf->len+len > buf->size){
+        buf->size = MAX(2*buf->size, buf->len+len);
+        char *tmp = (char*) realloc(buf->data, buf->size);
+        if (tmp==NULL){
+            message(WARN, "realloc() failed !");
+            return false;
+        }
+        buf->data = tmp;
+    }
+    memcpy(buf->data+buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+/* append decompressed data of content stream to buffer, after a space. FlateDecode
+ data is inflated straight into the buffer, so the stream is left as it is. Streams
+ with other filters are decompressed in place, then copied. */
+static bool join_content_stream (StreamObj *stream, JoinBuffer *buf)
+{
+    if (not join_buffer_add(" ", 1, buf))
+        return false;
+    PdfObject *filter = stream->dict[NAME_Filter];
+    if (isName(filter) && filter->name==NAME_FlateDecode && stream->len>0
+            && not stream->dict.contains(NAME_DecodeParms) && stream->load()) {
+        size_t len;
+        return zlib_decompress(stream->stream, stream->len, NULL, &len, join_buffer_add, buf)==0;
+    }
+    return stream->decompress() && join_buffer_add(stream->stream, stream->len, buf);
+}
+
 /* first create a new page object, and add this to object table. get old page contents,
 create new XObject using the contents, and add it to object table.
+At most PAGE_XOBJ_SLOTS objects are added to object table.
 */
 static void pdf_page_to_xobj (PdfPage *page)
 {
@@ -848,7 +1021,6 @@ static void pdf_page_to_xobj (PdfPage *page)
                 *contents, *cont, *pg, *xobj, *xobj_val;
     char * xobjname;
     char * stream_content = NULL;
-    static int revision = 1;
     if (not page->compressed)// we have already converted to xobj, nothing to do
         return;
 
@@ -864,13 +1036,13 @@ static void pdf_page_to_xobj (PdfPage *page)
     page->minor = doc->obj_table[major].minor;
     page->compressed = false;
 
-    new_page_xobject = new_page->dict->get("Resources")->dict->get("XObject");
+    new_page_xobject = new_page->dict->get(NAME_Resources)->dict->get(NAME_XObject);
 
-    cont = derefObject(pg->dict->get("Contents"), doc->obj_table);// it may be null
+    cont = derefObject(pg->dict->get(NAME_Contents), doc->obj_table);// it may be null
 
     if (isStream(cont)){
         major = stream_to_xobj(cont, pg, page->paper, doc->obj_table);
-        asprintf(&xobjname, "xo%d", revision++);
+        asprintf(&xobjname, "xo%d", major);
         xobj_val = new_page_xobject->dict->newItem(xobjname);
 
         xobj_val->setType(PDF_OBJ_INDIRECT_REF);
@@ -889,24 +1061,24 @@ static void pdf_page_to_xobj (PdfPage *page)
         PdfObject *tmp_stream = NULL;
         PdfObject *new_stream = new PdfObject;
         new_stream->setType(PDF_OBJ_STREAM);
-
+        // join decompressed data of all streams in a single buffer
+        JoinBuffer buf = {NULL, 0, 0};
         for (auto it = cont->array->begin(); it!=cont->array->end(); it++)
         {
-            tmp_stream = derefObject((*it), doc->obj_table);//decompressed stream
-            if (not tmp_stream->stream->decompress() ){
+            tmp_stream = derefObject((*it), doc->obj_table);
+            if (not isStream(tmp_stream) or not join_content_stream(tmp_stream->stream, &buf)){
                 message(FATAL, "Can not decompress content stream");
             }
-            pdf_stream_append(new_stream, " ", 1);
-            pdf_stream_append(new_stream, tmp_stream->stream->stream,
-                                            tmp_stream->stream->len);
         }
+        new_stream->stream->stream = buf.data;
+        new_stream->stream->len = buf.len;
         major = stream_to_xobj(new_stream, pg, page->paper, doc->obj_table);
 
         xobj = doc->obj_table.getObject(major, doc->obj_table[major].minor);
-        assert( xobj->stream->compress("FlateDecode") );
-        // each time different xobject rev numbers are used, so that we can
-        // join content streams of two pages without conflict
-        asprintf(&xobjname, "xo%d", revision++);
+        assert( xobj->stream->compress(NAME_FlateDecode) );
+        // xobject name is made from its object number, so that names are unique and
+        // we can join content streams of two pages without conflict
+        asprintf(&xobjname, "xo%d", major);
         xobj_val = new_page_xobject->dict->newItem(xobjname);
 
         xobj_val->setType(PDF_OBJ_INDIRECT_REF);
@@ -924,12 +1096,13 @@ empty_cont:
     //create content stream for new page
     contents = new PdfObject();
     contents->setType(PDF_OBJ_STREAM);
-    contents->stream->len = strlen(stream_content);
-    contents->stream->stream = stream_content;
+    // content stream is kept in chunks, as commands may add more content to it
+    contents->stream->append(stream_content, strlen(stream_content));
+    free(stream_content);
     // add content stream to object table
     major = doc->obj_table.addObject(contents);
 
-    new_page_contents = new_page->dict->get("Contents");
+    new_page_contents = new_page->dict->get(NAME_Contents);
     new_page_contents->indirect.major = major;
     new_page_contents->indirect.minor = doc->obj_table[major].minor;
 }
@@ -963,9 +1136,9 @@ PdfPage:: drawLine (Point begin, Point end, float width)
     pdf_page_to_xobj(this);
     page_obj = doc->obj_table.getObject(this->major, this->minor);
     // create new stream by joining page stream and line drawing commands
-    cont = page_obj->dict->get("Contents");
+    cont = page_obj->dict->get(NAME_Contents);
     cont = doc->obj_table.getObject(cont->indirect.major, cont->indirect.minor);
-    pdf_stream_append(cont, cmd, strlen(cmd));
+    cont->stream->append(cmd, strlen(cmd));
     free(cmd);
 }
 
@@ -986,10 +1159,10 @@ PdfPage:: drawText (const char *text, Point &pos, int size, Font font)
     pdf_page_to_xobj(this);
     page = doc->obj_table.getObject(this->major, this->minor);
     // /Resources << /Font << /FHelvetica 4 0 R >> XObject <</xo1 5 0 R >> >>
-    res = page->dict->get("Resources");
-    font_dict = res->dict->get("Font");
+    res = page->dict->get(NAME_Resources);
+    font_dict = res->dict->get(NAME_Font);
     if (not font_dict) {
-        font_dict = res->dict->newItem("Font");
+        font_dict = res->dict->newItem(NAME_Font);
         font_dict->setType(PDF_OBJ_DICT);
     }
     asprintf(&str, "F%s", font.name);
@@ -999,11 +1172,11 @@ PdfPage:: drawText (const char *text, Point &pos, int size, Font font)
     font_obj->indirect.minor = font.minor;
     free(str);
 
-    cont = page->dict->get("Contents");
+    cont = page->dict->get(NAME_Contents);
     stream = doc->obj_table.getObject(cont->indirect.major, cont->indirect.minor);
     // we dont want trailing zeros in a float, so we used %g instead of %f
     asprintf(&str, "\nq BT /F%s %d Tf  %g %g Td  (%s) Tj ET Q", font.name, size, pos.x, pos.y, text);
-    pdf_stream_append(stream, str, strlen(str));
+    stream->stream->append(str, strlen(str));
     free(str);
 }
 
@@ -1019,10 +1192,10 @@ PdfPage:: crop (Rect box)
     pdf_page_to_xobj(this);
     page_obj = doc->obj_table.getObject(this->major, this->minor);
     // create new stream by joining page stream and crop commands
-    cont = page_obj->dict->get("Contents");
+    cont = page_obj->dict->get(NAME_Contents);
     cont = doc->obj_table.getObject(cont->indirect.major, cont->indirect.minor);
-    pdf_stream_prepend(cont, cmd, strlen(cmd));
-    pdf_stream_append(cont, " Q", 2);
+    cont->stream->prepend(cmd, strlen(cmd));
+    cont->stream->append(" Q", 2);
     free(cmd);
 }
 
@@ -1042,18 +1215,19 @@ PdfPage:: mergePage (PdfPage &p2)
     // pages has been already converted to xobject. So xobjects and fonts are the
     // only resources of page objects. No two different XObjects or Fonts have
     // same name. So we can merge the Resources dicts safely
-    res1 = page1->dict->get("Resources");
-    res2 = page2->dict->get("Resources");
+    res1 = page1->dict->get(NAME_Resources);
+    res2 = page2->dict->get(NAME_Resources);
     //res2->write(stdout);
     res1->dict->merge(res2->dict);
 
-    cont = page1->dict->get("Contents");
+    cont = page1->dict->get(NAME_Contents);
     stream1 = doc->obj_table.getObject(cont->indirect.major, cont->indirect.minor);
-    cont = page2->dict->get("Contents");
+    cont = page2->dict->get(NAME_Contents);
     stream2 = doc->obj_table.getObject(cont->indirect.major, cont->indirect.minor);
 
-    pdf_stream_append(stream1, " ", 1);
-    pdf_stream_append(stream1, stream2->stream->stream, stream2->stream->len);
+    // data of stream2 is shared, not copied
+    stream1->stream->append(" ", 1);
+    stream1->stream->append(stream2->stream);
 }
 
 /* Apply the transformation matrix in PdfPage if the matrix is not unity matrix
@@ -1070,7 +1244,7 @@ PdfPage:: applyTransformation()
 
     page_obj = doc->obj_table.getObject(this->major, this->minor);
 
-    stream = page_obj->dict->get("Contents");
+    stream = page_obj->dict->get(NAME_Contents);
     stream = doc->obj_table.getObject(stream->indirect.major, stream->indirect.minor);
     if (stream->stream->len==0){
         return;
@@ -1080,8 +1254,8 @@ PdfPage:: applyTransformation()
             double2str(matrix.mat[1][0]).c_str(), double2str(matrix.mat[1][1]).c_str(),
             double2str(matrix.mat[2][0]).c_str(), double2str(matrix.mat[2][1]).c_str() );
 
-    pdf_stream_prepend(stream, str, strlen(str));
-    pdf_stream_append(stream, " Q", 2);
+    stream->stream->prepend(str, strlen(str));
+    stream->stream->append(" Q", 2);
     free(str);
 
     Matrix identity_matrix;
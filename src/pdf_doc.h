@@ -37,6 +37,9 @@ public:
     //void duplicateContent();
 };
 
+// max number of objects added when a page is converted to xobject
+#define PAGE_XOBJ_SLOTS 4
+
 typedef std::vector<PdfPage>::iterator PageIter;
 
 class PageList
@@ -46,7 +49,10 @@ public:
 
     int count();
     void append(PdfPage &page);
-    void remove(int index);// page index val is one less than page number
+    /* batch operations, these rebuild the list in a single pass. Index of a page
+     is one less than page number */
+    void filter(std::vector<bool> &keep);// remove pages whose keep flag is false
+    bool gather(std::vector<int> &indexes);// pages at given indexes (may repeat) in given order
     void clear();
     // allows range based for-loop
     PageIter begin();
@@ -68,6 +74,8 @@ public:
     PageList page_list;
     ObjectTable obj_table;
     PdfObject *trailer;
+    // input files are kept open, as stream objects read data from these files
+    std::vector<MYFILE*> input_files;
 
     bool encrypted;
     bool have_encrypt_info;
@@ -78,7 +86,7 @@ public:
     ~PdfDocument();
 
     bool getPdfHeader (MYFILE *f, char *line);
-    bool getPdfTrailer (MYFILE *f, char *line, long offset);
+    bool getPdfTrailer (MYFILE *f, char *line, off_t offset);
     bool getAllPages (MYFILE *f);
     bool getPdfPages (MYFILE *f, int major, int minor);
     bool open (const char *fname);
@@ -89,7 +97,9 @@ public:
     bool save (const char *filename);
 
     Font newFontObject(const char *font);
-    bool newBlankPage(int page_num);
+    PdfPage newBlankPage(Rect &paper);
+    void appendBlankPages(int count);
+    bool insertBlankPages(std::vector<int> &page_nums);
     void applyTransformations();
 };
 
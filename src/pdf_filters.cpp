@@ -2,125 +2,286 @@
 #include "pdf_filters.h"
 #include "debug.h"
 #include <zlib.h>
+#if (HAVE_LIBDEFLATE)
+#include <libdeflate.h>
+#endif
+#include <climits>
+#include <cstdlib>
 
-int flate_decode_filter(char **stream, size_t *len, DictObj &dict)
-{
-    if (*len==0) return 0;  // in some stream dict /Length in 0
-    // decompress stream using zlib
-    char *buff;
-    int predictor;
-    PdfObject *dec_params;
+// size of output chunks passed to DataSink
+#define INFLATE_CHUNK 65536
 
-    size_t new_stream_len = 3 * (*len);
-    char *new_stream_content = (char *) malloc(new_stream_len);
-    if (new_stream_content==NULL){
+/* Decompress zlib data incrementally, so that no data is decompressed twice.
+ If sink is NULL, output buffer grows as required, and decompressed data is returned
+ in *out. Otherwise data is passed to sink in chunks and *out is not used.
+ In both case *out_len is set to total decompressed size.
+ returns 0 on success and -1 on failure */
+int zlib_decompress(const char *in, size_t in_len, char **out, size_t *out_len,
+                    DataSink sink, void *sink_data)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit(&strm)!=Z_OK){
+        message(WARN, "zlib : inflateInit() failed !");
+        return -1;
+    }
+    size_t size = sink ? INFLATE_CHUNK : MAX(3*in_len, (size_t)1024);
+    char *buff = (char*) malloc(size);
+    if (buff==NULL){
         message(WARN, "zlib : malloc() failed !");
+        inflateEnd(&strm);
         return -1;
     }
-_z_d_try:
-    switch (uncompress((Bytef*)new_stream_content, (uLongf*)&new_stream_len,
-                                                    (Bytef*)*stream, *len))
-    {
-    case Z_OK:
-        break;
-    case Z_BUF_ERROR:
-        new_stream_len *= 2;
-        buff = (char*) realloc(new_stream_content, new_stream_len);
-        if (buff==NULL){
-            message(WARN, "zlib : realloc() failed !");
-            goto fail;
+    size_t total = 0;// total decompressed bytes
+    size_t used = 0;// bytes used in buff
+    strm.next_in = (Bytef*) in;
+    int ret = Z_OK;
+    while (ret!=Z_STREAM_END) {
+        // avail_in and avail_out are uInt, so feed large data in parts
+        if (strm.avail_in==0){
+            size_t consumed = (const char*)strm.next_in - in;
+            strm.avail_in = MIN(in_len-consumed, (size_t)UINT_MAX);
         }
-        new_stream_content = buff;
-        goto _z_d_try;
-    case Z_DATA_ERROR:
-        message(WARN, "zlib : invalid input data");
-    case Z_MEM_ERROR:
-    default:
-        goto fail;
-    }
-    // decode the decompressed stream
-    predictor = 1;
-    dec_params = dict["DecodeParms"];
-    if (dec_params)
-        predictor = dec_params->dict->get("Predictor")->integer;
-    // 10-15 = png filter
-    if (predictor == 12) {
-        int cols = dec_params->dict->get("Columns")->integer;
-        cols++; // the leading extra byte that stores filter type
-        int rows = new_stream_len/cols;
-        char *row_data, *prev_row_data;
-        char *empty_row = (char *) calloc(1,cols);;
-        prev_row_data = empty_row;
-        for (int row=0;row<rows;row++) {
-            row_data = new_stream_content + (row*cols);
-            // Predictor = 12, PNG Up filter in all rows
-            for (int col=1;col<cols;col++) {
-                row_data[col] = (row_data[col] + prev_row_data[col])%256;
+        if (used==size){
+            if (sink){
+                if (not sink(buff, used, sink_data))
+                    goto fail;
+                used = 0;
+            }
+            else {
+                size *= 2;
+                char *tmp = (char*) realloc(buff, size);
+                if (tmp==NULL){
+                    message(WARN, "zlib : realloc() failed !");
+                    goto fail;
+                }
+                buff = tmp;
             }
-            prev_row_data = row_data;
         }
-        free(empty_row);
-        // remove leading byte in each row
-        for (int row=0;row<rows;row++) {
-            memcpy(new_stream_content + row*(cols-1), new_stream_content+(row*cols+1), cols-1);
+        strm.next_out = (Bytef*) buff + used;
+        strm.avail_out = MIN(size-used, (size_t)UINT_MAX);
+        size_t avail_out = strm.avail_out;
+        ret = inflate(&strm, Z_NO_FLUSH);
+        used += avail_out - strm.avail_out;
+        total += avail_out - strm.avail_out;
+        switch (ret){
+        case Z_OK:
+        case Z_STREAM_END:
+            break;
+        case Z_BUF_ERROR:// no progress possible
+            if (strm.avail_out!=0){// all input consumed, but stream is incomplete
+                message(WARN, "zlib : incomplete input data");
+                goto fail;
+            }
+            break;
+        case Z_DATA_ERROR:
+            message(WARN, "zlib : invalid input data");
+        default:
+            goto fail;
         }
-        new_stream_len = rows*(cols-1);
     }
-    else if (predictor>1) {
-        message(WARN, "Unsupported FlateDecode predictor of type %d", predictor);
-        goto fail;
+    inflateEnd(&strm);
+    if (sink){
+        bool ok = used==0 || sink(buff, used, sink_data);
+        free(buff);
+        if (not ok)
+            return -1;
     }
-    free(*stream);
-    // shrink to content size
-    buff = (char*) realloc(new_stream_content, new_stream_len);
-    if (buff){
-        new_stream_content = buff;
-    }
-    // new_stream_len my be zero after decompress, in that case realloc() frees memory
-    if (!new_stream_len){
-        new_stream_content = NULL;
+    else {
+        // shrink to content size
+        if (total==0){
+            free(buff);
+            buff = NULL;
+        }
+        else {
+            char *tmp = (char*) realloc(buff, total);
+            if (tmp)
+                buff = tmp;
+        }
+        *out = buff;
     }
-    *stream = new_stream_content;
-    *len = new_stream_len;
+    *out_len = total;
     return 0;
 fail:
-    free(new_stream_content);
+    inflateEnd(&strm);
+    free(buff);
     return -1;
 }
 
-int zlib_compress_filter(char **stream, size_t *len, DictObj &dict)
+// ---------------- PNG and TIFF predictors ----------------
+// the inner loops work on unsigned bytes, so overflow wraps around like %256
+
+static inline int paeth_predictor(int a, int b, int c)
 {
-    char *buff;
-    long new_stream_len = 2 * (*len);
-    char *new_stream_content = (char *) malloc(new_stream_len);
-    if (new_stream_content==NULL)
+    // a = left, b = above, c = upper left
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - 2*c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return (pb <= pc) ? b : c;
+}
+
+/* Reverse PNG filters. Each row of data begins with a filter type byte. Rows are
+ decoded in place, and each decoded row is stored just after previous decoded row,
+ so the filter type bytes are removed without any extra copying pass.
+ A decoded byte is never written after the input bytes which are still to be read. */
+static int png_unpredict(unsigned char *data, size_t *len, int bpp, size_t row_len)
+{
+    size_t rows = *len / (row_len+1);
+    unsigned char *zero_row = (unsigned char*) calloc(1, row_len);
+    if (zero_row==NULL)
         return -1;
-try_comp:
-    switch (compress((Bytef*)new_stream_content, (uLongf*)&new_stream_len,
-                                                (Bytef*)*stream, *len))
-    {
-    case Z_OK:
-        break;
-    case Z_BUF_ERROR:
-        new_stream_len *= 2;
-        buff = (char*) realloc(new_stream_content, new_stream_len);
-        if (buff==NULL){
-            message(WARN, "zlib : realloc() failed !");
-            goto fail;
+    const unsigned char *up = zero_row;// previous decoded row
+    for (size_t row=0; row<rows; row++) {
+        const unsigned char *in = data + row*(row_len+1);
+        int filter_type = *in++;
+        unsigned char *out = data + row*row_len;
+        size_t i;
+        switch (filter_type) {
+        case 0:// None
+            memmove(out, in, row_len);
+            break;
+        case 1:// Sub
+            for (i=0; i<(size_t)bpp && i<row_len; i++)
+                out[i] = in[i];
+            for (; i<row_len; i++)
+                out[i] = in[i] + out[i-bpp];
+            break;
+        case 2:// Up
+            for (i=0; i<row_len; i++)
+                out[i] = in[i] + up[i];
+            break;
+        case 3:// Average
+            for (i=0; i<(size_t)bpp && i<row_len; i++)
+                out[i] = in[i] + (up[i]>>1);
+            for (; i<row_len; i++)
+                out[i] = in[i] + ((out[i-bpp] + up[i])>>1);
+            break;
+        case 4:// Paeth
+            for (i=0; i<(size_t)bpp && i<row_len; i++)
+                out[i] = in[i] + up[i];// paeth_predictor(0, b, 0) is b
+            for (; i<row_len; i++)
+                out[i] = in[i] + paeth_predictor(out[i-bpp], up[i], up[i-bpp]);
+            break;
+        default:
+            message(WARN, "invalid PNG filter type %d", filter_type);
+            free(zero_row);
+            return -1;
         }
-        new_stream_content = buff;
-        goto try_comp;
-    case Z_MEM_ERROR:
-    case Z_DATA_ERROR:
-    default:
-        goto fail;
+        up = out;
     }
-    free(*stream);
-    // shrink to content size
-    buff = (char*) realloc(new_stream_content, new_stream_len);
-    if (buff){
-        new_stream_content = buff;
+    free(zero_row);
+    *len = rows*row_len;
+    return 0;
+}
+
+// Reverse TIFF predictor 2 (horizontal differencing) in place
+static int tiff_unpredict(unsigned char *data, size_t len, int colors, int bpc,
+                                int columns, size_t row_len)
+{
+    size_t rows = len / row_len;
+    size_t samples = (size_t)colors * columns;// samples per row
+    for (size_t row=0; row<rows; row++) {
+        unsigned char *p = data + row*row_len;
+        switch (bpc) {
+        case 8:
+            for (size_t i=colors; i<samples; i++)
+                p[i] += p[i-colors];
+            break;
+        case 16:// big endian 16 bit samples
+            for (size_t i=colors; i<samples; i++) {
+                unsigned val = ((p[2*i]<<8) | p[2*i+1]) + ((p[2*(i-colors)]<<8) | p[2*(i-colors)+1]);
+                p[2*i] = val>>8;
+                p[2*i+1] = val;
+            }
+            break;
+        case 1:
+        case 2:
+        case 4:
+        {
+            unsigned mask = (1<<bpc) - 1;
+            int per_byte = 8/bpc;
+            for (size_t i=colors; i<samples; i++) {
+                size_t prev = i-colors;
+                int shift = 8 - bpc*(i%per_byte + 1);
+                int prev_shift = 8 - bpc*(prev%per_byte + 1);
+                unsigned val = (p[i/per_byte]>>shift) + (p[prev/per_byte]>>prev_shift);
+                p[i/per_byte] = (p[i/per_byte] & ~(mask<<shift)) | ((val & mask)<<shift);
+            }
+            break;
+        }
+        default:
+            message(WARN, "TIFF predictor : unsupported BitsPerComponent %d", bpc);
+            return -1;
+        }
     }
+    return 0;
+}
+
+// decode predictor data in place. len may become smaller
+static int unpredict(unsigned char *data, size_t *len, int predictor, int colors, int bpc, int columns)
+{
+    if (colors<1 || bpc<1 || columns<1 || (long)colors*bpc*columns > INT_MAX){
+        message(WARN, "invalid predictor params (Colors %d, BitsPerComponent %d, Columns %d)",
+                        colors, bpc, columns);
+        return -1;
+    }
+    size_t row_len = ((size_t)colors*bpc*columns + 7)/8;
+    int bpp = MAX(1, colors*bpc/8);// bytes per pixel, for PNG filters
+    // 10-15 = png filter, where each row has its own filter type
+    if (predictor >= 10 && predictor <= 15)
+        return png_unpredict(data, len, bpp, row_len);
+    if (predictor == 2)
+        return tiff_unpredict(data, *len, colors, bpc, columns, row_len);
+    message(WARN, "Unsupported FlateDecode predictor of type %d", predictor);
+    return -1;
+}
+
+// get DecodeParms dict of stream, returns NULL if not found
+static PdfObject* get_decode_params(DictObj &dict)
+{
+    PdfObject *dec_params = dict[NAME_DecodeParms];
+    if (isArray(dec_params) && dec_params->array->count()==1)// [ /FlateDecode ] filter array
+        dec_params = dec_params->array->at(0);
+    return isDict(dec_params) ? dec_params : NULL;
+}
+
+// apply predictor given in DecodeParms on decompressed data (in place)
+static int apply_predictor(char *data, size_t *len, DictObj &dict)
+{
+    PdfObject *dec_params = get_decode_params(dict);
+    if (dec_params==NULL)
+        return 0;
+    PdfObject *val;
+    int predictor=1, colors=1, bpc=8, columns=1;
+    if ((val=dec_params->dict->get(NAME_Predictor)) && isInt(val))
+        predictor = val->integer;
+    if ((val=dec_params->dict->get(NAME_Colors)) && isInt(val))
+        colors = val->integer;
+    if ((val=dec_params->dict->get(NAME_BitsPerComponent)) && isInt(val))
+        bpc = val->integer;
+    if ((val=dec_params->dict->get(NAME_Columns)) && isInt(val))
+        columns = val->integer;
+    if (predictor>1 && unpredict((unsigned char*)data, len, predictor, colors, bpc, columns)!=0)
+        return -1;
+    // data no longer needs these params
+    dict.deleteItem(NAME_DecodeParms);
+    return 0;
+}
+
+int flate_decode_filter(char **stream, size_t *len, DictObj &dict)
+{
+    if (*len==0) return 0;  // in some stream dict /Length in 0
+    // decompress stream using zlib
+    size_t new_stream_len;
+    char *new_stream_content;
+    if (zlib_decompress(*stream, *len, &new_stream_content, &new_stream_len)!=0)
+        return -1;
+    // decode the decompressed stream
+    if (apply_predictor(new_stream_content, &new_stream_len, dict)!=0)
+        goto fail;
+    free(*stream);
     *stream = new_stream_content;
     *len = new_stream_len;
     return 0;
@@ -129,222 +290,238 @@ fail:
     return -1;
 }
 
-
-#if (HAVE_LZW)
-#define DICT_LEN 4096
-struct lzw_dict{
-    size_t symbol;
-    size_t prev;
-    size_t len;
-};
-
-enum { LZW_CL_DICT = 256, LZW_END_STREAM = 257 };
-
-static int lzw_raw_get_ch(unsigned char * buf,size_t len,size_t * index, size_t * offset,size_t length){
-    int out;
-    if (*index == len){
-        return EOF;
-    }
-    out = ( (1<<(8 - *offset)) - 1) & buf[*index];
-/*
-    if (length<=(8-*offset)){
-        (*offset) += length;
-        (*offset) %= 8;
-        out &=((1<<length) -1) << (8 - *offset);
-        return out;
-    }*/
-    length = length - 8 + *offset;
-    *offset = 0;
-    (*index)++;
-    if (*index == len){
-        return EOF;
-    }
-    while (length>=8){
-        length-=8;
-        out = (out << 8) | buf[*index];
-        (*index)++;
-        if (*index == len){
-            return EOF;
+#if (HAVE_LIBDEFLATE)
+// compress data in zlib format using libdeflate. returns compressed size, or 0 on failure
+static size_t deflate_compress(const char *in, size_t in_len, char *out, size_t out_len)
+{
+    // allocating compressor is costly, so each thread keeps one until it exits
+    struct Compressor {
+        struct libdeflate_compressor *ptr = NULL;
+        ~Compressor() {
+            if (ptr!=NULL)
+                libdeflate_free_compressor(ptr);
         }
+    };
+    static thread_local Compressor compressor;
+    if (compressor.ptr==NULL){
+        compressor.ptr = libdeflate_alloc_compressor(compress_level<0 ? 6 : compress_level);
+        if (compressor.ptr==NULL)
+            return 0;
     }
-    if (length){
-        out = (out << (length)) | ((buf[*index]>>(8-length)) & ((1<<length) - 1));
-    }
-    *offset = length;
-    (*offset) %= 8;
-    return out;
+    return libdeflate_zlib_compress(compressor.ptr, in, in_len, out, out_len);
 }
 
-static void lzw_clear_dict(struct lzw_dict dict[DICT_LEN], size_t alpha_len)
+// max compressed size of given length data
+static size_t deflate_bound(size_t len)
 {
-    for (size_t i=0;i<alpha_len;++i){
-        dict[i].symbol = i;
-            dict[i].prev = 0;
-        dict[i].len = 1;
-    }
-    for (size_t i=alpha_len;i>DICT_LEN;++i){
-        dict[i].symbol = 0;
-        dict[i].prev = 0;
-        dict[i].len = 0;
-    }
+    return libdeflate_zlib_compress_bound(NULL, len);
+}
+#else
+static size_t deflate_compress(const char *in, size_t in_len, char *out, size_t out_len)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, compress_level, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY)!=Z_OK)
+        return 0;
+    strm.next_in = (Bytef*) in;
+    strm.next_out = (Bytef*) out;
+    size_t consumed = 0, used = 0;
+    int ret;
+    // avail_in and avail_out are uInt, so feed large data in parts
+    do {
+        if (strm.avail_in==0){
+            strm.avail_in = MIN(in_len-consumed, (size_t)UINT_MAX);
+            consumed += strm.avail_in;
+        }
+        strm.avail_out = MIN(out_len-used, (size_t)UINT_MAX);
+        size_t avail_out = strm.avail_out;
+        ret = deflate(&strm, consumed==in_len ? Z_FINISH : Z_NO_FLUSH);
+        used += avail_out - strm.avail_out;
+    } while (ret==Z_OK && used<out_len);
+    deflateEnd(&strm);
+    return ret==Z_STREAM_END ? used : 0;
 }
 
-#define lzw_add_prefix(dict,prev_word,word,d_index) do{\
-    if (d_index>DICT_LEN){\
-        message(WARN,"Bad LZW stream - expected clear-table code");\
-        return -1;\
-    }\
-    if ((size_t)word<d_index && word>=0){\
-        lzw_dict[d_index].symbol = word;\
-        lzw_dict[d_index].prev = prev_word;\
-        lzw_dict[d_index].len = dict[prev_word].len + 1;\
-            prev_word=word;\
-            while (lzw_dict[prev_word].prev){\
-                prev_word = lzw_dict[prev_word].prev;\
-            }\
-            lzw_dict[d_index].symbol = prev_word;\
-    }\
-    else{\
-        if ((size_t)word==d_index){\
-            lzw_dict[d_index].prev = prev_word;\
-            lzw_dict[d_index].len = dict[prev_word].len + 1;\
-            while (lzw_dict[prev_word].prev){\
-                prev_word = lzw_dict[prev_word].prev;\
-            }\
-            lzw_dict[d_index].symbol = prev_word;\
-        }\
-        else{\
-            message(WARN,"Bad LZW stream - unexpected code");\
-            return -1;\
-        }\
-    }\
-    ++d_index;\
-    switch (d_index + early){\
-    case 512:\
-        w_size=10;\
-        break;\
-    case 1024:\
-        w_size=11;\
-        break;\
-    case 2048:\
-          w_size=12;\
-        break;\
-    }\
-}while(0)
+static size_t deflate_bound(size_t len)
+{
+    return compressBound(len);
+}
+#endif
 
-static void lzw_put_prefix(int word, struct lzw_dict dict[DICT_LEN], char ** out, int * len, int * index){
-    char * tmp;
-    if ( word>DICT_LEN ||  word<0 || dict[word].len<=0){
-        return;
+int zlib_compress_filter(char **stream, size_t *len, DictObj &dict)
+{
+    size_t out_len = deflate_bound(*len);
+    char *new_stream_content = (char *) malloc(out_len);
+    if (new_stream_content==NULL){
+        message(WARN, "zlib : malloc() failed !");
+        return -1;
     }
-    if (dict[word].len == 1){
-        if (*len == *index){
-            *len *= 2;
-            tmp = (char*) realloc(*out, *len);
-            if (tmp==NULL){
-                message(FATAL, "realloc() failed !");
-            }
-            *out = tmp;
-        }
-
-        (*out)[*index] = dict[word].symbol;
-        (*index)++;
+    size_t new_stream_len = deflate_compress(*stream, *len, new_stream_content, out_len);
+    if (new_stream_len==0){
+        free(new_stream_content);
+        return -1;
     }
-    else{
-        lzw_put_prefix(dict[word].prev,dict,out,len,index);
-        lzw_put_prefix(dict[word].symbol,dict,out,len,index);
+    free(*stream);
+    // shrink to content size
+    char *buff = (char*) realloc(new_stream_content, new_stream_len);
+    if (buff){
+        new_stream_content = buff;
     }
+    *stream = new_stream_content;
+    *len = new_stream_len;
+    return 0;
 }
 
+
+#if (HAVE_LZW)
+#define LZW_DICT_LEN 4096
+
+enum { LZW_CL_DICT = 256, LZW_END_STREAM = 257, LZW_FIRST_CODE = 258 };
+
+// each dict entry is previous entry (prefix) + one byte (suffix)
+struct lzw_entry {
+    uint16_t prefix;
+    uint16_t len;// length of string of this entry
+    unsigned char suffix;// last byte
+    unsigned char first;// first byte of string
+};
+
 int lzw_decompress_filter(char **stream, size_t *len, DictObj &dict)
 {
-    if (len==0)
+    if (*len==0)
         return 0;
-    struct lzw_dict lzw_dict[DICT_LEN +1];
-    size_t index, offset, w_size, d_index = LZW_END_STREAM + 1;
-    int word;
-    int prev_word = LZW_CL_DICT;
-    int out_index = 0;
     int early = 1;
-    int out_len = 3 * (*len);
+    PdfObject *early_val, *dec_params = get_decode_params(dict);
+    if (dec_params)
+        early_val = dec_params->dict->get(NAME_EarlyChange);
+    else
+        early_val = dict[NAME_EarlyChange];
+    if (isInt(early_val))
+        early = early_val->integer;
 
-    char *out_buf = (char *) malloc(out_len);
-    if (out_buf==NULL){
+    struct lzw_entry lzw_dict[LZW_DICT_LEN];
+    for (int i=0; i<256; i++) {
+        lzw_dict[i].prefix = 0;
+        lzw_dict[i].len = 1;
+        lzw_dict[i].suffix = i;
+        lzw_dict[i].first = i;
+    }
+    size_t out_len = 4 * (*len);
+    size_t out_pos = 0;
+    unsigned char *out = (unsigned char*) malloc(out_len);
+    if (out==NULL){
         message(WARN, "lzw : malloc() failed !");
         return -1;
     }
+    const unsigned char *in = (unsigned char*) *stream;
+    const unsigned char *in_end = in + *len;
+    uint32_t bit_buf = 0;// next bits are at the most significant side
+    int bit_count = 0;
+    int code_len = 9;
+    int next_code = LZW_FIRST_CODE;
+    int prev_code = -1;// no previous code after clear-table code
 
-    PdfObject *early_val = dict["EarlyChange"];
-    if (early_val!=NULL && early_val->type == PDF_OBJ_INT){
-        early = early_val->integer;
-    }
-
-    index = 0;
-    w_size = 9;
-
-    do {
-        offset = 0;
-        word = lzw_raw_get_ch((unsigned char *)*stream,*len,&index,&offset,w_size);
-    } while(word != EOF && word != LZW_CL_DICT);
-
-    if (word == EOF){
-        message(WARN, "lzw : reached EOF !");
-        free(out_buf);
-        return -1;
-    }
+    while (1) {
+        // read next code
+        while (bit_count < code_len && in < in_end) {
+            bit_buf = (bit_buf << 8) | *in++;
+            bit_count += 8;
+        }
+        if (bit_count < code_len)
+            break;// reached end of data without end-of-data code
+        bit_count -= code_len;
+        int code = (bit_buf >> bit_count) & ((1<<code_len) - 1);
 
-    do {
-        if (word==LZW_CL_DICT){
-            lzw_clear_dict(lzw_dict,256);
-            d_index = LZW_END_STREAM + 1;
-            w_size=9;
+        if (code==LZW_CL_DICT){
+            next_code = LZW_FIRST_CODE;
+            code_len = 9;
+            prev_code = -1;
+            continue;
+        }
+        if (code==LZW_END_STREAM)
+            break;
+        if (code > next_code || (code==next_code && prev_code<0)){
+            message(WARN, "Bad LZW stream - unexpected code");
+            free(out);
+            return -1;
+        }
+        // add new entry = prev string + first byte of this string.
+        // if code==next_code, this string is prev string + its own first byte
+        if (prev_code>=0 && next_code < LZW_DICT_LEN){
+            lzw_entry &entry = lzw_dict[next_code];
+            entry.prefix = prev_code;
+            entry.len = lzw_dict[prev_code].len + 1;
+            entry.first = lzw_dict[prev_code].first;
+            entry.suffix = (code==next_code) ? entry.first : lzw_dict[code].first;
+            next_code++;
+            if (next_code + early >= (1<<code_len) && code_len < 12)
+                code_len++;
+        }
+        else if (code==next_code){// dict is full
+            message(WARN, "Bad LZW stream - expected clear-table code");
+            free(out);
+            return -1;
         }
-        else{
-            if (prev_word!=LZW_CL_DICT){
-                lzw_add_prefix(lzw_dict,prev_word,word,d_index);
+        // write the string of this code, from last byte to first byte
+        size_t str_len = lzw_dict[code].len;
+        if (out_pos + str_len > out_len){
+            out_len = 2*out_len + str_len;
+            unsigned char *tmp = (unsigned char*) realloc(out, out_len);
+            if (tmp==NULL){
+                message(WARN, "lzw : realloc() failed !");
+                free(out);
+                return -1;
             }
-            lzw_put_prefix(word,lzw_dict,&out_buf,&out_len,&out_index);
+            out = tmp;
         }
-        prev_word = word;
-        word = lzw_raw_get_ch((unsigned char *)*stream,*len,&index,&offset,w_size);
-    } while(word != EOF && word != LZW_END_STREAM);
-
-    *len = out_index;
+        unsigned char *p = out + out_pos + str_len;
+        for (int c=code; p > out + out_pos; c = lzw_dict[c].prefix) {
+            *--p = lzw_dict[c].suffix;
+        }
+        out_pos += str_len;
+        prev_code = code;
+    }
+    // decode the decompressed stream
+    if (apply_predictor((char*)out, &out_pos, dict)!=0){
+        free(out);
+        return -1;
+    }
     free(*stream);
-    *stream = out_buf;
+    *stream = (char*) out;
+    *len = out_pos;
     return 0;
 }
 #endif
 
 /*filter mapping for decompression*/
 stream_filters  _decompress_filters[]= {
-    {"FlateDecode",     flate_decode_filter},
-    {"LZWDecode",       lzw_decompress_filter},
-    {"ASCII85Decode",   NULL},
-    {"DCTDecode",       NULL},
-    {"RunLengthDecode", NULL},
-    {"CCITTFaxDecode",  NULL},
-    {"JBIG2Decode",     NULL},
-    {"JPXDecode",       NULL},
-    {"Crypt",           NULL}
+    {NAME_FlateDecode,     flate_decode_filter},
+    {NAME_LZWDecode,       lzw_decompress_filter},
+    {NAME_ASCII85Decode,   NULL},
+    {NAME_DCTDecode,       NULL},
+    {NAME_RunLengthDecode, NULL},
+    {NAME_CCITTFaxDecode,  NULL},
+    {NAME_JBIG2Decode,     NULL},
+    {NAME_JPXDecode,       NULL},
+    {NAME_Crypt,           NULL}
 };
 /*filter mapping for compressions*/
 stream_filters  _compress_filters[] = {
-    {"FlateDecode",     zlib_compress_filter},
-    {"LZWDecode",       NULL},
-    {"ASCII85Decode",   NULL},
-    {"DCTDecode",       NULL},
-    {"RunLengthDecode", NULL},
-    {"CCITTFaxDecode",  NULL},
-    {"JBIG2Decode",     NULL},
-    {"JPXDecode",       NULL},
-    {"Crypt",           NULL}
+    {NAME_FlateDecode,     zlib_compress_filter},
+    {NAME_LZWDecode,       NULL},
+    {NAME_ASCII85Decode,   NULL},
+    {NAME_DCTDecode,       NULL},
+    {NAME_RunLengthDecode, NULL},
+    {NAME_CCITTFaxDecode,  NULL},
+    {NAME_JBIG2Decode,     NULL},
+    {NAME_JPXDecode,       NULL},
+    {NAME_Crypt,           NULL}
 };
 
-int apply_filter(const char *name, char **stream, size_t *len, DictObj &dict, stream_filters *filters, size_t f_len)
+int apply_filter(int name, char **stream, size_t *len, DictObj &dict, stream_filters *filters, size_t f_len)
 {
     for (size_t i=0; i<f_len; ++i){
-        if (strcmp(name,filters[i].name)==0){
+        if (name==filters[i].name){
             if (filters[i].filter != NULL){
                 return  filters[i].filter(stream,len,dict);
             }
@@ -356,11 +533,11 @@ int apply_filter(const char *name, char **stream, size_t *len, DictObj &dict, st
     return -1;
 }
 
-int apply_decompress_filter(const char *name, char **stream, size_t *len, DictObj &dict) {
+int apply_decompress_filter(int name, char **stream, size_t *len, DictObj &dict) {
     return apply_filter(name, stream, len, dict, _decompress_filters, sizeof(_decompress_filters)/sizeof(stream_filters));
 }
 
-int apply_compress_filter(const char *name, char **stream, size_t *len, DictObj &dict) {
+int apply_compress_filter(int name, char **stream, size_t *len, DictObj &dict) {
     return apply_filter(name, stream, len, dict, _compress_filters, sizeof(_decompress_filters)/sizeof(stream_filters));
 }
 
@@ -7,6 +7,12 @@
 int zlib_compress_filter(char **stream, size_t *len, DictObj &dict);
 int flate_decode_filter(char **stream, size_t *len, DictObj &dict);
 
+// receives decompressed data chunk by chunk. returns false to stop decompression
+typedef bool (*DataSink)(const char *data, size_t len, void *sink_data);
+
+int zlib_decompress(const char *in, size_t in_len, char **out, size_t *out_len,
+                    DataSink sink=NULL, void *sink_data=NULL);
+
 
 #if (HAVE_LZW)
     int lzw_decompress_filter(char **stream, size_t *len, DictObj &dict);
@@ -15,11 +21,11 @@ int flate_decode_filter(char **stream, size_t *len, DictObj &dict);
 #endif
 
 typedef struct {
-    const char *name;
+    int name;// name atom of filter
     int (*filter)(char **stream, size_t *len, DictObj &dict);
 } stream_filters;
 
-int apply_filter(const char *name, char **stream, size_t *len, DictObj &dict, stream_filters *filters, size_t f_len);
-int apply_compress_filter(const char *name, char **stream, size_t *len, DictObj &dict);
-int apply_decompress_filter(const char *name, char **stream, size_t *len, DictObj &dict);
+int apply_filter(int name, char **stream, size_t *len, DictObj &dict, stream_filters *filters, size_t f_len);
+int apply_compress_filter(int name, char **stream, size_t *len, DictObj &dict);
+int apply_decompress_filter(int name, char **stream, size_t *len, DictObj &dict);
 
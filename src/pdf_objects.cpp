@@ -3,86 +3,316 @@
 #include "pdf_objects.h"
 #include <cstring>
 #include <cassert>
+#include <climits>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
 #include "debug.h"
 #include "pdf_filters.h"
+#if (HAVE_SSE2)
+#include <emmintrin.h>
+#endif
 
 
 // *********** ------------- Array Object ----------------- ***********
+ArrayObj:: ArrayObj() {
+    items = NULL;
+    len = capacity = 0;
+}
 //allows range based for loop
 ArrayIter ArrayObj:: begin() {
-    return array.begin();
+    return ArrayIter(items);
 }
 ArrayIter ArrayObj:: end() {
-    return array.end();
+    return ArrayIter(items+len);
 }
 int ArrayObj:: count () {
-    return array.size();
+    return len;
 }
 PdfObject* ArrayObj:: at (int index) {
-    return array[index];
+    return &items[index];
 }
+
+// when full, items are copied to a new block, and old block is left in arena.
+// so pointers to items must not be kept while adding new items
+PdfObject* ArrayObj:: newItem ()
+{
+    if (len==capacity) {
+        capacity = capacity ? 2*capacity : 8;
+        PdfObject *new_items = (PdfObject*) current_arena()->alloc(capacity*sizeof(PdfObject));
+        if (len)
+            memcpy((void*)new_items, (void*)items, len*sizeof(PdfObject));
+        items = new_items;
+    }
+    PdfObject *item = &items[len++];
+    item->type = PDF_OBJ_UNKNOWN;
+    return item;
+}
+
 void ArrayObj:: append (PdfObject *item) {
-    array.push_back(item);
+    memcpy((void*)newItem(), (void*)item, sizeof(PdfObject));
+    item->type = PDF_OBJ_UNKNOWN;
+}
+
+void ArrayObj:: removeLast() {
+    items[--len].clear();
 }
 
 void ArrayObj:: deleteItems()
 {
-    for (PdfObject *item : array){
-        delete item;
+    for (int i=0; i<len; i++){
+        items[i].clear();
     }
-    array.clear();
+    len = 0;
 }
 
-int ArrayObj:: write (FILE *f)
+int ArrayObj:: write (OutFile *f)
 {
-    int ret_val = fprintf(f, "[ ");
-    for (PdfObject *obj : this->array){
-        ret_val = obj->write(f);
-        ret_val = fprintf(f, " ");
+    f->write("[ ", 2);
+    for (int i=0; i<len; i++){
+        items[i].write(f);
+        f->putChar(' ');
+    }
+    f->putChar(']');
+    return 0;
+}
+
+// *********** ------------- Name Table ----------------- ***********
+#define NAME_CHUNK_LEN 4096
+#define NAME_MAX_CHUNKS 4096
+
+// open addressing hash table of atoms. a slot holds atom+1, or 0 if empty
+struct NameSlots {
+    unsigned mask;// number of slots - 1
+    std::atomic<int> *slots;
+};
+
+/* Names are looked up by multiple threads while reading objects. Almost all names
+ are already in table, so lookup is done without lock, and only adding a name is
+ done under a lock. Name strings are stored in chunks which never move. Slots are
+ never changed once filled, and when the hash table grows, a new one is published
+ and the old one is kept, so a reader never sees freed memory. A reader which
+ does not find a name in an old table searches again under the lock.
+ The table lives until program exits, so it has no destructor. */
+class NameTable
+{
+public:
+    std::mutex lock;
+    std::atomic<NameSlots*> hash;
+    const char **chunks[NAME_MAX_CHUNKS];
+    int count;
+
+    NameTable() {
+        count = 0;
+        memset(chunks, 0, sizeof(chunks));
+        hash.store(newSlots(1024), std::memory_order_relaxed);
+        const char *predefined[] = {
+#define X(name) #name,
+            PDF_NAME_LIST(X)
+#undef X
+        };
+        for (const char *name : predefined)
+            add(name, strlen(name), hashOf(name, strlen(name)));
+    }
+    static unsigned hashOf(const char *name, int len) {
+        unsigned h = 2166136261u;// FNV-1a
+        for (int i=0; i<len; i++)
+            h = (h ^ (unsigned char)name[i]) * 16777619u;
+        return h;
+    }
+    // returns atom of name, or -1 if not found
+    int find(const char *name, int len, unsigned h) {
+        NameSlots *table = hash.load(std::memory_order_acquire);
+        for (unsigned i = h & table->mask; ; i = (i+1) & table->mask) {
+            int val = table->slots[i].load(std::memory_order_acquire);
+            if (val==0)
+                return -1;
+            const char *str = chunks[(val-1)/NAME_CHUNK_LEN][(val-1)%NAME_CHUNK_LEN];
+            if (strncmp(str, name, len)==0 && str[len]==0)
+                return val-1;
+        }
+    }
+    // must be called with lock held, after find() failed
+    int add(const char *name, int len, unsigned h) {
+        if (count == NAME_CHUNK_LEN*NAME_MAX_CHUNKS)
+            message(FATAL, "too many pdf names");
+        if (chunks[count/NAME_CHUNK_LEN]==NULL)
+            chunks[count/NAME_CHUNK_LEN] = (const char**) malloc2(NAME_CHUNK_LEN*sizeof(char*));
+        char *str = (char*) malloc2(len+1);
+        memcpy(str, name, len);
+        str[len] = 0;
+        chunks[count/NAME_CHUNK_LEN][count%NAME_CHUNK_LEN] = str;
+        int atom = count++;
+        NameSlots *table = hash.load(std::memory_order_relaxed);
+        if (2*(unsigned)count > table->mask) {
+            // keep load factor below half, rehash all names in a bigger table
+            NameSlots *new_table = newSlots(2*(table->mask+1));
+            for (int i=0; i<count; i++){
+                const char *key = chunks[i/NAME_CHUNK_LEN][i%NAME_CHUNK_LEN];
+                insert(new_table, i, hashOf(key, strlen(key)));
+            }
+            hash.store(new_table, std::memory_order_release);
+        }
+        else {
+            insert(table, atom, h);
+        }
+        return atom;
+    }
+    int get(const char *name, int len) {
+        unsigned h = hashOf(name, len);
+        int atom = find(name, len, h);
+        if (atom>=0)
+            return atom;
+        std::lock_guard<std::mutex> guard(lock);
+        atom = find(name, len, h);// may have been added by another thread
+        return atom>=0 ? atom : add(name, len, h);
+    }
+private:
+    static NameSlots* newSlots(unsigned size) {
+        NameSlots *table = new NameSlots;
+        table->mask = size-1;
+        table->slots = new std::atomic<int>[size];
+        for (unsigned i=0; i<size; i++)
+            table->slots[i].store(0, std::memory_order_relaxed);
+        return table;
+    }
+    static void insert(NameSlots *table, int atom, unsigned h) {
+        unsigned i = h & table->mask;
+        while (table->slots[i].load(std::memory_order_relaxed)!=0)
+            i = (i+1) & table->mask;
+        table->slots[i].store(atom+1, std::memory_order_release);
     }
-    ret_val = fprintf(f, "]");
-    return ret_val<0?ret_val:0;
+};
+
+static NameTable& name_table()
+{
+    // allocated once and never destroyed, so threads still running at exit can use it
+    static NameTable *table = new NameTable();
+    return *table;
+}
+
+int name_atom (const char *name)
+{
+    return name_table().get(name, strlen(name));
+}
+
+int name_atom (const char *name, int len)
+{
+    return name_table().get(name, len);
+}
+
+int name_find (const char *name)
+{
+    int len = strlen(name);
+    NameTable &table = name_table();
+    return table.find(name, len, NameTable::hashOf(name, len));
+}
+
+const char* atom_name (int atom)
+{
+    return name_table().chunks[atom/NAME_CHUNK_LEN][atom%NAME_CHUNK_LEN];
 }
 
 // *********** ------------ Dictionary Object -------------- ***********
-void DictObj:: setDict (std::map<std::string, PdfObject*> &map){
-    this->dict = map;
+DictObj:: DictObj() {
+    items = NULL;
+    order = NULL;
+    len = capacity = 0;
 }
 
-bool DictObj:: contains (std::string key) {
-    return (dict.count(key) > 0);
+DictIter DictObj:: find (int key) {
+    return std::lower_bound(items, items+len, key,
+                [](const DictItem &item, int key) { return item.first < key; });
 }
 
-PdfObject* DictObj:: get (std::string key) {
-    if (dict.count(key) < 1)
+// when full, items are copied to a new block, and old block is left in arena
+DictIter DictObj:: insert (DictIter pos, int key, PdfObject *val)
+{
+    int index = pos - items;
+    order = NULL;
+    if (len==capacity) {
+        capacity = capacity ? 2*capacity : 4;
+        DictItem *new_items = (DictItem*) current_arena()->alloc(capacity*sizeof(DictItem));
+        std::copy(items, items+len, new_items);
+        items = new_items;
+    }
+    std::copy_backward(items+index, items+len, items+len+1);
+    len++;
+    items[index] = DictItem(key, val);
+    return items+index;
+}
+
+// sort items by key. for duplicate keys, last item is kept
+void DictObj:: setItems (DictItem *new_items, int count)
+{
+    std::stable_sort(new_items, new_items+count,
+                [](const DictItem &a, const DictItem &b) { return a.first < b.first; });
+    items = (DictItem*) current_arena()->alloc(count*sizeof(DictItem));
+    order = NULL;
+    capacity = count;
+    len = 0;
+    for (int i=0; i<count; i++){
+        if (len>0 && items[len-1].first==new_items[i].first){
+            delete items[len-1].second;
+            items[len-1].second = new_items[i].second;
+        }
+        else {
+            items[len++] = new_items[i];
+        }
+    }
+}
+
+bool DictObj:: contains (int key) {
+    return get(key)!=NULL;
+}
+
+PdfObject* DictObj:: get (int key) {
+    DictIter it = find(key);
+    if (it==items+len || it->first!=key)
         return NULL;
-    return dict[key];
+    return it->second;
+}
+
+PdfObject* DictObj:: get (const char *key) {
+    int atom = name_find(key);
+    return atom<0 ? NULL : get(atom);
 }
 
-void DictObj:: add (std::string key, PdfObject *val) {
-    dict[key] = val;
+// if key exists, the old value is replaced (not deleted)
+void DictObj:: add (int key, PdfObject *val) {
+    DictIter it = find(key);
+    if (it!=items+len && it->first==key)
+        it->second = val;
+    else
+        insert(it, key, val);
 };
 
-PdfObject* DictObj:: newItem (std::string key)
+PdfObject* DictObj:: newItem (int key)
 {
-    if (dict.count(key) > 0) {
-        dict[key]->clear();
+    DictIter it = find(key);
+    if (it!=items+len && it->first==key) {
+        it->second->clear();
+        return it->second;
     }
-    else {
-        dict[key] = new PdfObject();
-    }
-    return dict[key];
+    PdfObject *val = new PdfObject();
+    insert(it, key, val);
+    return val;
+}
+
+PdfObject* DictObj:: newItem (const char *key) {
+    return newItem(name_atom(key));
 }
 
 // hard copy all items from src_dict to this, overwrite if exists
 // this dict and src_dict must be different object, otherwise will cause segfault
 void DictObj:: merge(DictObj *src_dict)
 {
-    for (auto it : src_dict->dict) {
+    for (auto it : *src_dict) {
         // if val of key is dict obj, merge the dicts
-        if (this->contains(it.first) && dict[it.first]->type==PDF_OBJ_DICT &&
-                                        it.second->type==PDF_OBJ_DICT) {
-            dict[it.first]->dict->merge(it.second->dict);
+        PdfObject *val = this->get(it.first);
+        if (val && val->type==PDF_OBJ_DICT && it.second->type==PDF_OBJ_DICT) {
+            val->dict->merge(it.second->dict);
             continue;
         }
         PdfObject *item = this->newItem(it.first);
@@ -92,90 +322,188 @@ void DictObj:: merge(DictObj *src_dict)
 
 void DictObj:: filter(DictFilter &filter_set)
 {
-    for (auto it=dict.begin(); it!=dict.end();) {
-        std::string key = it->first;
-        PdfObject *val = it->second;
-        it++;//it must be placed before dict.erase()
-        if (filter_set.count(key) == 0) {
-            delete val;
-            dict.erase(key);
-        }
+    int count = 0;
+    for (int i=0; i<len; i++) {
+        if (filter_set.count(items[i].first) == 0)
+            delete items[i].second;
+        else
+            items[count++] = items[i];
     }
+    len = count;
+    order = NULL;
 }
 
-void DictObj:: deleteItem (std::string key)
+void DictObj:: deleteItem (int key)
 {
-    if (dict.count(key) > 0) {
-        PdfObject *val = dict[key];
-        delete val;
-        dict.erase(key);
+    DictIter it = find(key);
+    if (it!=items+len && it->first==key) {
+        delete it->second;
+        std::copy(it+1, items+len, it);
+        len--;
+        order = NULL;
     }
 }
 
 void DictObj:: deleteItems()
 {
-    for (auto it : dict) {
+    for (auto it : *this) {
         delete it.second;
     }
-    dict.clear();
+    len = 0;
+    order = NULL;
 }
 
-int DictObj:: write (FILE *f)
+// items are written in order of key names, so output does not depend on atom values
+int DictObj:: write (OutFile *f)
 {
-    fprintf(f, "<<\n");
-
-    for (auto it : dict){
-        fprintf(f, "/%s ", it.first.c_str());
-        PdfObject *val = it.second;
-        val->write(f);
-        fprintf(f,"\n");
+    f->write("<<\n", 3);
+    // the order is kept until keys are changed, so it is sorted only once
+    if (order==NULL && len>0){
+        order = (int*) current_arena()->alloc(len*sizeof(int));
+        for (int i=0; i<len; i++)
+            order[i] = i;
+        std::sort(order, order+len, [this](int a, int b) {
+                return strcmp(atom_name(items[a].first), atom_name(items[b].first)) < 0; });
+    }
+    for (int i=0; i<len; i++){
+        DictItem &item = items[order[i]];
+        f->putChar('/');
+        f->putStr(atom_name(item.first));
+        f->putChar(' ');
+        item.second->write(f);
+        f->putChar('\n');
     }
-    fprintf(f,">>");
+    f->write(">>", 2);
     return 0;
 }
 
-MapIter DictObj:: begin() {
-    return dict.begin();
+DictIter DictObj:: begin() {
+    return items;
 }
-MapIter DictObj:: end() {
-    return dict.end();
+DictIter DictObj:: end() {
+    return items+len;
 }
 
-PdfObject* DictObj:: operator[] (std::string key) {
-    if (dict.count(key) < 1)
-        return NULL;
-    return dict[key];
+PdfObject* DictObj:: operator[] (int key) {
+    return get(key);
 }
 
 
 // *********** ------------- Stream Object ----------------- ***********
 
-static int get_correct_stream_len(MYFILE *f, size_t begin);
+static off_t get_correct_stream_len(MYFILE *f, off_t begin);
 
 
 StreamObj:: StreamObj() {
     stream = NULL;
+    file = NULL;
+    chunks = last_chunk = NULL;
+    owner = current_arena()->ownBuffer(&stream);
+    begin = 0;
     len = 0;
     decompressed = false;
 }
 
-int StreamObj:: write (FILE *f)
+// join all chunks in stream buffer
+static bool join_chunks(StreamObj *obj)
 {
-    if (!dict.contains("Length")){
-        PdfObject *item = this->dict.newItem("Length");
+    char *data = (char*) malloc(obj->len);
+    if (data==NULL){
+        message(WARN,"StreamObj : failed to allocate memory of size %zu", obj->len);
+        return false;
+    }
+    char *ptr = data;
+    for (StreamChunk *chunk=obj->chunks; chunk!=NULL; chunk=chunk->next){
+        memcpy(ptr, chunk->data, chunk->len);
+        ptr += chunk->len;
+    }
+    obj->stream = data;
+    obj->chunks = obj->last_chunk = NULL;
+    return true;
+}
+
+// read stream data from input file, if not read yet
+bool StreamObj:: load()
+{
+    if (chunks!=NULL)
+        return join_chunks(this);
+    if (stream!=NULL || file==NULL || len==0)
+        return true;
+    stream = (char*) malloc(len);
+    if (stream==NULL){
+        message(WARN,"StreamObj : failed to allocate memory of size %zu", len);
+        return false;
+    }
+    bool ok;
+    if (file->f==NULL){
+        // whole file is in memory. copy data without changing seek pos of file, so that
+        // streams of same file can be loaded by multiple threads
+        ok = (size_t)begin+len <= (size_t)(file->end - file->buf);
+        if (ok)
+            memcpy(stream, file->buf+begin, len);
+    }
+    else {
+        off_t fpos = myftell(file);
+        ok = myfseek(file, begin, SEEK_SET)==0 && myfread(stream, 1, len, file)==len;
+        myfseek(file, fpos, SEEK_SET);
+    }
+    if (not ok){
+        message(WARN,"failed to read stream data of size %zu at pos %lld", len, (long long)begin);
+        free(stream);
+        stream = NULL;
+        return false;
+    }
+    file = NULL;
+    return true;
+}
+
+// copy not loaded stream data from input file to output file
+static int write_from_file(MYFILE *src, off_t begin, size_t len, OutFile *f)
+{
+    if (src->f==NULL){// mapped file or string, whole data is in memory
+        if ((size_t)begin+len > (size_t)(src->end - src->buf))
+            return -1;
+        f->write(src->buf+begin, len);
+        return 0;
+    }
+    char buff[65536];
+    off_t fpos = myftell(src);
+    if (myfseek(src, begin, SEEK_SET)!=0)
+        return -1;
+    while (len>0) {
+        size_t n = myfread(buff, 1, MIN(len, sizeof(buff)), src);
+        if (n==0)
+            break;
+        f->write(buff, n);
+        len -= n;
+    }
+    myfseek(src, fpos, SEEK_SET);
+    return len==0 ? 0 : -1;
+}
+
+int StreamObj:: write (OutFile *f)
+{
+    if (!dict.contains(NAME_Length)){
+        PdfObject *item = this->dict.newItem(NAME_Length);
         item->type = PDF_OBJ_INT;
     }
-    this->dict["Length"]->integer = this->len;
+    this->dict[NAME_Length]->integer = this->len;
     this->dict.write(f);
-    fprintf(f,"\nstream\n");
+    f->write("\nstream\n", 8);
 
     if (this->len){
-        assert (this->stream!=NULL);// TODO : remove it later
-        if (fwrite(this->stream, 1, this->len, f) != this->len){
-            message(FATAL, "StreamObj : fwrite() error");
+        if (this->chunks!=NULL){
+            for (StreamChunk *chunk=chunks; chunk!=NULL; chunk=chunk->next)
+                f->write(chunk->data, chunk->len);
+        }
+        else if (this->stream!=NULL){
+            f->write(this->stream, this->len);
+        }
+        else if (write_from_file(this->file, this->begin, this->len, f)!=0){
+            message(FATAL, "StreamObj : failed to copy stream data from input file");
         }
     }
-    fprintf(f, "\nendstream");
+    f->write("\nendstream", 10);
     return 0;
 }
 
@@ -183,7 +511,9 @@ bool StreamObj:: decompress()
 {
     if (decompressed)
         return true;
-    PdfObject *p_obj = this->dict["Filter"];
+    if (not load())
+        return false;
+    PdfObject *p_obj = this->dict[NAME_Filter];
     if (!p_obj or len==0) {
         decompressed = true;
         return true;
@@ -194,7 +524,7 @@ bool StreamObj:: decompress()
         for (PdfObject *filter : *p_obj->array){
             assert(filter->type==PDF_OBJ_NAME);
             if (apply_decompress_filter(filter->name, &(this->stream), &(this->len), this->dict) != 0){
-                message(WARN, "failed to apply decompress filter %s", filter->name);
+                message(WARN, "failed to apply decompress filter %s", atom_name(filter->name));
                 return false;
             }
         }
@@ -202,7 +532,7 @@ bool StreamObj:: decompress()
     }
     case PDF_OBJ_NAME:
         if (apply_decompress_filter(p_obj->name, &(this->stream), &(this->len), this->dict) != 0){
-            message(WARN, "failed to apply decompress filter %s", p_obj->name);
+            message(WARN, "failed to apply decompress filter %s", atom_name(p_obj->name));
             return false;
         }
         break;
@@ -210,44 +540,124 @@ bool StreamObj:: decompress()
         message(WARN, "could not decompress stream obj of type %d", p_obj->type);
         return false;
     }
-    this->dict.deleteItem("Filter");
+    this->dict.deleteItem(NAME_Filter);
     decompressed = true;
     return true;
 }
 
-bool StreamObj:: compress (const char *filter)
+static StreamChunk* new_chunk(const char *data, size_t size)
+{
+    StreamChunk *chunk = (StreamChunk*) current_arena()->alloc(sizeof(StreamChunk));
+    chunk->data = data;
+    chunk->len = size;
+    chunk->next = NULL;
+    return chunk;
+}
+
+static void add_chunk(StreamObj *obj, StreamChunk *chunk)
+{
+    if (obj->chunks==NULL)
+        obj->chunks = chunk;
+    else
+        obj->last_chunk->next = chunk;
+    obj->last_chunk = chunk;
+    obj->len += chunk->len;
+}
+
+/* move data from stream buffer or file to a chunk, so that it can be shared.
+ The buffer is not copied, the arena becomes its owner and frees it at the end.
+ As chunk data is never modified, a stream which is going to modify its data
+ gets its own copy when chunks are joined by load() (copy on write). */
+static void move_data_to_chunks(StreamObj *obj)
+{
+    if (obj->chunks!=NULL || obj->len==0)
+        return;
+    if (not obj->load())
+        message(FATAL, "Can not read stream data");
+    char **data = (char**) current_arena()->alloc(sizeof(char*));
+    *data = obj->stream;
+    current_arena()->ownBuffer(data);
+    obj->stream = NULL;
+    size_t size = obj->len;
+    obj->len = 0;
+    add_chunk(obj, new_chunk(*data, size));
+}
+
+void StreamObj:: prepend (const char *data, size_t size)
+{
+    if (size==0)
+        return;
+    move_data_to_chunks(this);
+    StreamChunk *chunk = new_chunk(current_arena()->copyString(data, size), size);
+    chunk->next = chunks;
+    chunks = chunk;
+    if (last_chunk==NULL)
+        last_chunk = chunk;
+    len += size;
+}
+
+void StreamObj:: append (const char *data, size_t size)
+{
+    if (size==0)
+        return;
+    move_data_to_chunks(this);
+    add_chunk(this, new_chunk(current_arena()->copyString(data, size), size));
+}
+
+void StreamObj:: append (StreamObj *src)
+{
+    move_data_to_chunks(this);
+    move_data_to_chunks(src);
+    copyChunks(src);
+}
+
+void StreamObj:: copyChunks (StreamObj *src)
+{
+    // src may be this stream, so stop at the chunk which was last before copying
+    StreamChunk *last = src->last_chunk;
+    for (StreamChunk *chunk=src->chunks; chunk!=NULL; chunk=chunk->next) {
+        add_chunk(this, new_chunk(chunk->data, chunk->len));
+        if (chunk==last)
+            break;
+    }
+}
+
+bool StreamObj:: compress (int filter)
 {
-    char *ch;
-    if (len==0)
+    if (len==0 || compress_level==0)// level 0 means streams are stored uncompressed
         return true;
+    if (not load())
+        return false;
 
     if (apply_compress_filter(filter, &(this->stream), &(this->len), this->dict) != 0){
         return false;
     }
-    PdfObject *filter_obj = this->dict.get("Filter");
+    PdfObject *filter_obj = this->dict.get(NAME_Filter);
+    PdfObject *item;
 
     if (!filter_obj) {
-        filter_obj = this->dict.newItem("Filter");
-        asprintf(&ch,"/%s",filter);
-        filter_obj->readFromString(ch);
-        free(ch);
+        filter_obj = this->dict.newItem(NAME_Filter);
+        filter_obj->setType(PDF_OBJ_NAME);
+        filter_obj->name = filter;
     }
     else {// already contains a filter
         switch (filter_obj->type){
         case PDF_OBJ_ARRAY:
-            {
-            asprintf(&ch,"/%s",filter);
-            PdfObject *array_item = new PdfObject();
-            array_item->readFromString(ch);
-            free(ch);
-            filter_obj->array->append(array_item);
-            }
+            item = filter_obj->array->newItem();
+            item->setType(PDF_OBJ_NAME);
+            item->name = filter;
             break;
         case PDF_OBJ_NAME:
-            asprintf(&ch, " [ /%s /%s ] ", filter_obj->name, filter);
-            filter_obj->clear();
-            filter_obj->readFromString(ch);
-            free(ch);
+            {
+            int old_filter = filter_obj->name;
+            filter_obj->setType(PDF_OBJ_ARRAY);
+            item = filter_obj->array->newItem();
+            item->setType(PDF_OBJ_NAME);
+            item->name = old_filter;
+            item = filter_obj->array->newItem();
+            item->setType(PDF_OBJ_NAME);
+            item->name = filter;
+            }
             break;
         default:
             assert(0);
@@ -260,6 +670,7 @@ StreamObj:: ~StreamObj() {
     if (stream!=NULL){
         free(stream);
     }
+    owner->ptr = NULL;
     dict.deleteItems();
 }
 
@@ -292,14 +703,13 @@ PdfObject:: setType(ObjectType obj_type)
     case PDF_OBJ_STREAM:
         stream = new StreamObj();
         break;
-    case PDF_OBJ_INDIRECT:
-        indirect.obj = new PdfObject();
-        break;
     default:
         break;
     }
 }
 
+static bool parse_object (PdfObject *root, Lexer &lex, ObjectTable *xref);
+
 // create a MYFILE from given string and call PdfObject::get()
 bool
 PdfObject:: readFromString (const char *str)
@@ -308,300 +718,399 @@ PdfObject:: readFromString (const char *str)
     if (f==NULL){
         return false;
     }
-    bool retval = this->read(f, NULL, NULL);
+    bool retval = this->read(f, NULL);
     myfclose(f);
     return retval;
 }
 
 /*To read an obj at particular pos, seek file in that pos and call this function.
+  If obj_id is not NULL, its major is set to -1 if an indirect object is not found.
   Returns false if object is completely unusable and should be discarded.
   Returns true if obj is usable, even if not read properly.
   Dictionary and Array return false only if ending bracket not found before reaching EOF.
 */
 bool
-PdfObject:: read (MYFILE *f, ObjectTable *xref, Token *last_tok)
+PdfObject:: read (MYFILE *f, ObjectTable *xref, IndirectObj *obj_id)
 {
-    int stream_len = 0;
-    size_t fpos/*, key_pos, nextkey_pos, val_pos*/;
-    Token tok;
-    if (last_tok==NULL){
-        last_tok=&tok;
+    Lexer lex(f);
+    return this->read(lex, xref, obj_id);
+}
+
+bool
+PdfObject:: read (Lexer &lex, ObjectTable *xref, IndirectObj *obj_id)
+{
+    if (obj_id!=NULL){
+        obj_id->major = -1;
     }
-    //printf("get obj %ld\n", myftell(f));
-    while (last_tok->get(f)){
-        switch (last_tok->type){
-        case TOK_INT://maybe integer, indirect, or indirect reference obj
-        {
-            this->setType(PDF_OBJ_INT);
-            this->integer = last_tok->integer;
-            if (last_tok->sign){//it is integer, not indirect object
-                return true;
-            }
-            fpos = myftell(f);
-            last_tok->get(f);
-            if (last_tok->type!=TOK_INT || last_tok->sign){// not indirect object
-                last_tok->freeData();
-                if ( myfseek(f, fpos, SEEK_SET)==-1 ){
-                    message(FATAL,"myfseek()  error in file %s at line %d", __FILE__, __LINE__);
-                }
-                return true;
-            }
-            // we have two integers, check if there is 'obj' or 'R' next to it
-            last_tok->get(f);
-            if (last_tok->type!=TOK_ID){
-                last_tok->freeData();
-                if (myfseek(f,fpos,SEEK_SET)==-1){
-                    message(FATAL,"myfseek()  error in file %s at line  %d",__FILE__, __LINE__);
-                }
-                return true;
-            }
-            this->indirect.major = this->integer;
-            this->indirect.minor = last_tok->integer;
+    if (not lex.get()){
+        return false;
+    }
+    Token &tok = lex.tok();
+    if (obj_id==NULL || tok.type!=TOK_INT || tok.sign){
+        return parse_object(this, lex, xref);
+    }
+    // check if it is 'N G obj ... endobj'
+    Token &gen_tok = lex.peek(1);
+    if (gen_tok.type!=TOK_INT || gen_tok.sign || lex.peek(2).type!=TOK_ID || !lex.peek(2).is("obj")){
+        return parse_object(this, lex, xref);
+    }
+    obj_id->major = tok.integer;
+    obj_id->minor = gen_tok.integer;
+    lex.skip(2);
+    // the object inside 'N G obj ... endobj' is read into this object
+    if (not (lex.get() && parse_object(this, lex, xref))){
+        debug("IndirectObj %d %d : failed to read", obj_id->major, obj_id->minor);
+        return false;
+    }
+    lex.get();
+    if (lex.tok().type!=TOK_ID || !lex.tok().is("endobj")){
+        debug("IndirectObj %d %d : endobj keyword not found", obj_id->major, obj_id->minor);
+    }
+    return true;
+}
 
-            if (strcmp(last_tok->id,"R")==0){
-                this->setType(PDF_OBJ_INDIRECT_REF);
-                return true;
-            }
-            if (strcmp(last_tok->id,"obj")==0){
-                this->setType(PDF_OBJ_INDIRECT);
-                if (not this->indirect.obj->read(f,xref,last_tok)){
-                    debug("IndirectObj %d %d : failed to read", indirect.major, indirect.minor);
-                    return false;
-                }
-                last_tok->get(f);
-                if (last_tok->type!=TOK_ID || strcmp(last_tok->id,"endobj")!=0){
-                    debug("IndirectObj %d %d : endobj keyword not found", indirect.major, indirect.minor);
-                }
-                return true;
-            }
-            // two int numbers and a TOK_ID next to it other than 'R' and 'obj'
-            if (myfseek(f,fpos,SEEK_SET)==-1){
-                message(FATAL,"myfseek()  error in file %s at line %d",__FILE__,__LINE__);
-            }
-            return true;
+enum {
+    VALUE_FAILED,
+    VALUE_OK,
+    VALUE_ARRAY,// array begins, its items follow
+    VALUE_DICT
+};
+
+// read the object whose first token is current token of lexer. returns VALUE_ARRAY
+// or VALUE_DICT if token begins an array or dictionary
+static int read_value (PdfObject *obj, Lexer &lex)
+{
+    Token &tok = lex.tok();
+    switch (tok.type){
+    case TOK_INT://maybe integer or indirect reference obj
+    {
+        obj->setType(PDF_OBJ_INT);
+        obj->integer = tok.integer;
+        if (tok.sign){//it is integer, not reference
+            return VALUE_OK;
         }
-        case TOK_REAL:
-        {
-            this->setType(PDF_OBJ_REAL);
-            this->real = last_tok->real;
-            return true;
+        // check if next two tokens are unsigned integer and 'R'.
+        // if not, they remain in lexer queue to be read as next objects
+        Token &gen_tok = lex.peek(1);
+        if (gen_tok.type!=TOK_INT || gen_tok.sign){
+            return VALUE_OK;
         }
-        case TOK_NAME:
-        {
-            this->setType(PDF_OBJ_NAME);
-            this->name = strdup(last_tok->name);
-            return true;
+        Token &id_tok = lex.peek(2);
+        if (id_tok.type==TOK_ID && id_tok.is("R")){
+            obj->indirect.major = obj->integer;
+            obj->indirect.minor = gen_tok.integer;
+            obj->setType(PDF_OBJ_INDIRECT_REF);
+            lex.skip(2);
         }
-        case TOK_STR:
-        {
-            this->setType(PDF_OBJ_STR);
-            this->str = last_tok->str;
-            //this->str.type = last_tok->str.type;
+        return VALUE_OK;
+    }
+    case TOK_REAL:
+        obj->setType(PDF_OBJ_REAL);
+        obj->real = tok.real;
+        return VALUE_OK;
+    case TOK_NAME:
+        obj->setType(PDF_OBJ_NAME);
+        obj->name = name_atom(tok.data, tok.len);
+        return VALUE_OK;
+    case TOK_STR:
+        obj->setType(PDF_OBJ_STR);
+        obj->str = new_string(tok.data, tok.len);
+        return VALUE_OK;
+    case TOK_BDICT:// dictionary or stream obj
+        return VALUE_DICT;
+    case TOK_BARRAY:
+        obj->setType(PDF_OBJ_ARRAY);
+        return VALUE_ARRAY;
+    case TOK_ID:
+        if (tok.is("null")){
+            obj->setType(PDF_OBJ_NULL);
+            return VALUE_OK;
+        }
+        if (tok.is("true")){
+            obj->setType(PDF_OBJ_BOOL);
+            obj->boolean = true;
+            return VALUE_OK;
+        }
+        if (tok.is("false")){
+            obj->setType(PDF_OBJ_BOOL);
+            obj->boolean = false;
+            return VALUE_OK;
+        }
+        debug("unknown id '%.*s'", tok.len, tok.data);
+        return VALUE_FAILED;
+    case TOK_EOF:
+    case TOK_EARRAY:
+    case TOK_EDICT:
+    case TOK_UNKNOWN:
+    default:
+        return VALUE_FAILED;
+    }
+}
+
+// an array or dictionary whose items are being read
+typedef struct {
+    PdfObject *obj;
+    bool is_array;
+    size_t base;// index of first item of dict in dict item stack
+    int key;// key of val
+    PdfObject *val;// last value of dict, added when next key or end of dict is found
+    int next_obj;// DICT_KEY or DICT_VAL
+} ParseFrame;
+
+// items of nested dicts are pushed on same stack, after items of parent dict
+static thread_local std::vector<DictItem> dict_items;
+// frames of nested arrays and dicts. nested parse_object() calls (eg. while
+// reading stream length obj) use the part of stack after frames of the caller
+static thread_local std::vector<ParseFrame> parse_frames;
+
+static bool read_stream_data (PdfObject *obj, Lexer &lex, ObjectTable *xref);
+
+// add the item read in array. returns true if end of array is reached
+static bool array_add_item (ParseFrame &frame, bool item_ok, Lexer &lex)
+{
+    if (item_ok)
+        return false;
+    frame.obj->array->removeLast();
+    return lex.tok().type==TOK_EARRAY || lex.tok().type==TOK_EOF;
+}
+
+// add the key or value read in dict. returns true if end of dict is reached
+static bool dict_add_item (ParseFrame &frame, PdfObject *obj, bool item_ok, Lexer &lex)
+{
+    if (not item_ok) {
+        delete obj;
+        if (lex.tok().type==TOK_EDICT or lex.tok().type==TOK_EOF){
+            if (frame.val)
+                dict_items.push_back(DictItem(frame.key, frame.val));
             return true;
         }
-        case TOK_BDICT:// dictionary or stream obj
-        {
-            std::map<std::string, PdfObject*>  new_dict;
-            PdfObject *obj, *val=NULL, *len_obj=NULL;
-            std::string key;
-            int next_obj = DICT_KEY;
-            while ((obj = new PdfObject())) {
-                if (not obj->read(f, xref, last_tok)) {
-                    delete obj;
-                    if (last_tok->type==TOK_EDICT or last_tok->type==TOK_EOF){
-                        if (val)
-                            new_dict[key] = val;
-                        break;
-                    }
-                    next_obj = DICT_KEY;// if could not read key or val, next object should be key
-                }
-                else if (next_obj==DICT_KEY){
-                    if (obj->type==PDF_OBJ_NAME){
-                        if (val){
-                            new_dict[key] = val;
-                            val = NULL;
-                        }
-                        key = obj->name;
-                        next_obj = DICT_VAL;
-                    }
-                    else if (val) {// have read object, but it is not PdfName
-                        delete val;// previous val is invalid
-                        val = NULL;
-                    }
-                    delete obj;
-                }
-                else {// next_obj==DICT_VAL
-                    val = obj;
-                    next_obj = DICT_KEY;
-                }
-            }
-            if (last_tok->type==TOK_EOF){// last token should be TOK_EDICT
-                debug("Dictionary : ending bracket not found");
-                this->setType(PDF_OBJ_DICT);
-                this->dict->setDict(new_dict);
-                return false;
-            }
-            fpos = myftell(f);
-            // if dict has stream keyword, then it is stream object
-            if ( (not last_tok->get(f))
-                    || last_tok->type!=TOK_ID
-                    || strcmp(last_tok->id, "stream")!=0) {
-                this->setType(PDF_OBJ_DICT);
-                this->dict->setDict(new_dict);
-                myfseek(f, fpos, SEEK_SET);
-                return true;
-            }
-            this->setType(PDF_OBJ_STREAM);
-            this->stream->dict.setDict(new_dict);
-            // if stream length is indirect obj, get length as integer
-            if (new_dict.count("Length")==0){
-                debug("StreamObj : /Length key not found");
-                return false;
-            }
-            len_obj = new_dict["Length"];
-            if (len_obj->type==PDF_OBJ_INDIRECT_REF){
-                fpos = myftell(f);
-                xref->readObject(f, len_obj->indirect.major);
-                len_obj = xref->table[len_obj->indirect.major].obj;
-                myfseek(f, fpos, SEEK_SET);
-            }
-            if (!isInt(len_obj)){
-                debug("StreamObj : invalid stream length obj type %d", len_obj->type);
-                return false;
-            }
-            stream_len = len_obj->integer;
-            this->stream->dict.deleteItem("Length");
-            // read stream after the newline
-            switch (mygetc(f)){
-                case EOF:
-                    return false;
-                case CHAR_CR:
-                    if (mygetc(f)!=CHAR_LF){
-                        myungetc(f);
-                    }
-                case CHAR_LF:
-                    break;
-                default:
-                    myungetc(f);
-                    break;
-            }
-            this->stream->begin = myftell(f);
-read_stream:
-            this->stream->len = stream_len;
-            if (stream_len){
-                this->stream->stream = (char*) malloc(stream_len);
-                if (this->stream->stream==NULL){
-                    message(WARN,"StreamObj : failed to allocate memory of size %d", stream_len);
-                    this->stream->len = 0;
-                    return false;
-                }
-                if (myfread(this->stream->stream,1,stream_len,f)!=(size_t)stream_len){
-                    message(WARN,"failed to read stream data of size %d at pos %d",
-                            stream_len, this->stream->begin);
-                    this->stream->len = 0;
-                    return false;
-                }
+        frame.next_obj = DICT_KEY;// if could not read key or val, next object should be key
+    }
+    else if (frame.next_obj==DICT_KEY){
+        if (obj->type==PDF_OBJ_NAME){
+            if (frame.val){
+                dict_items.push_back(DictItem(frame.key, frame.val));
+                frame.val = NULL;
             }
+            frame.key = obj->name;
+            frame.next_obj = DICT_VAL;
+        }
+        else if (frame.val) {// have read object, but it is not PdfName
+            delete frame.val;// previous val is invalid
+            frame.val = NULL;
+        }
+        delete obj;
+    }
+    else {// next_obj==DICT_VAL
+        frame.val = obj;
+        frame.next_obj = DICT_KEY;
+    }
+    return false;
+}
 
-            if (not last_tok->get(f)
-                || last_tok->type!=TOK_ID
-                || strcmp(last_tok->id,"endstream")!=0)// may be wrong stream Length
-            {
-                stream_len = get_correct_stream_len(f, this->stream->begin);
-                if (stream_len == -1){
-                    debug("StreamObj : endstream keyword not found");
-                    return false;
-                }
-                debug("StreamObj : fixing wrong value of stream length");
-                if (this->stream->stream){
-                    free(this->stream->stream);
-                    this->stream->stream = NULL;
-                }
-                assert(myfseek(f, this->stream->begin, SEEK_SET)==0);
-                goto read_stream;
-            }
-            return true;
+// set type and items of the array or dict whose end is reached
+static bool end_container (ParseFrame &frame, Lexer &lex, ObjectTable *xref)
+{
+    PdfObject *obj = frame.obj;
+    if (frame.is_array) {
+        if (lex.tok().type!=TOK_EARRAY){
+            debug("Array : ending bracket not found");
+            return false;
         }
-        case TOK_BARRAY:
-        {
-            this->setType(PDF_OBJ_ARRAY);
-            // if start bracket is found, read until end bracked or EOF is reached
-            PdfObject *item_obj;
-            while ((item_obj = new PdfObject())){
-                if (item_obj->read(f,xref,last_tok)){
-                    this->array->append(item_obj);
-                }
-                else {
-                    delete item_obj;
-                    if (last_tok->type==TOK_EARRAY || last_tok->type==TOK_EOF)
-                        break;
+        return true;
+    }
+    DictItem *items = dict_items.data() + frame.base;
+    int count = dict_items.size() - frame.base;
+    if (lex.tok().type==TOK_EOF){// last token should be TOK_EDICT
+        debug("Dictionary : ending bracket not found");
+        obj->setType(PDF_OBJ_DICT);
+        obj->dict->setItems(items, count);
+        dict_items.resize(frame.base);
+        return false;
+    }
+    // if dict has stream keyword, then it is stream object
+    Token &next_tok = lex.peek(1);
+    if (next_tok.type!=TOK_ID || !next_tok.is("stream")) {
+        obj->setType(PDF_OBJ_DICT);
+        obj->dict->setItems(items, count);
+        dict_items.resize(frame.base);
+        return true;
+    }
+    lex.skip(1);
+    obj->setType(PDF_OBJ_STREAM);
+    obj->stream->dict.setItems(items, count);
+    dict_items.resize(frame.base);
+    return read_stream_data(obj, lex, xref);
+}
+
+/* Arrays and dicts are read using a stack of frames instead of recursion,
+  so that deeply nested objects can not overflow the call stack. */
+static bool parse_object (PdfObject *root, Lexer &lex, ObjectTable *xref)
+{
+    int ret = read_value(root, lex);
+    if (ret==VALUE_OK || ret==VALUE_FAILED)
+        return ret==VALUE_OK;
+
+    size_t base = parse_frames.size();
+    PdfObject *obj = root;
+    while (true) {
+        if (ret==VALUE_ARRAY || ret==VALUE_DICT) {
+            if (parse_frames.size()-base == PDF_MAX_NESTING) {
+                message(WARN, "objects are nested too deep");
+                // discard partly read objects
+                for (size_t i=parse_frames.size(); i>base+1; i--) {
+                    ParseFrame &frame = parse_frames[i-1];
+                    if (not frame.is_array)
+                        delete frame.val;
                 }
-            }
-            if (last_tok->type!=TOK_EARRAY){
-                debug("Array : ending bracket not found");
+                if (not parse_frames[base].is_array)
+                    dict_items.resize(parse_frames[base].base);
+                parse_frames.resize(base);
+                root->clear();
                 return false;
             }
-            return true;
+            ParseFrame frame = {obj, ret==VALUE_ARRAY, dict_items.size(), 0, NULL, DICT_KEY};
+            parse_frames.push_back(frame);
         }
-        case TOK_ID:
-        {
-            if (strcmp(last_tok->id,"null")==0){
-                this->setType(PDF_OBJ_NULL);
-                return true;
-            }
-            if (strcmp(last_tok->id,"true")==0){
-                this->setType(PDF_OBJ_BOOL);
-                this->boolean = true;
-                return true;
+        else {
+            // the item is complete. add it to its container, and if the container
+            // ends here, it becomes an item of its parent
+            bool item_ok = (ret==VALUE_OK);
+            while (true) {
+                ParseFrame &frame = parse_frames.back();
+                bool ended = frame.is_array ? array_add_item(frame, item_ok, lex)
+                                            : dict_add_item(frame, obj, item_ok, lex);
+                if (not ended)
+                    break;
+                obj = frame.obj;
+                item_ok = end_container(frame, lex, xref);
+                parse_frames.pop_back();
+                if (parse_frames.size()==base)
+                    return item_ok;
             }
-            if (strcmp(last_tok->id,"false")==0){
-                this->setType(PDF_OBJ_BOOL);
-                this->boolean = false;
-                return true;
+        }
+        // read next item of the innermost container
+        ParseFrame &frame = parse_frames.back();
+        obj = frame.is_array ? frame.obj->array->newItem() : new PdfObject();
+        ret = lex.get() ? read_value(obj, lex) : VALUE_FAILED;
+    }
+}
+
+// read stream data after 'stream' keyword
+static bool read_stream_data (PdfObject *obj, Lexer &lex, ObjectTable *xref)
+{
+    MYFILE *f = lex.f;
+    StreamObj *stream = obj->stream;
+    PdfObject tmp_len;// holds indirect stream length obj if it is not loaded in table
+    // if stream length is indirect obj, get length as integer
+    PdfObject *len_obj = stream->dict.get(NAME_Length);
+    if (len_obj==NULL){
+        debug("StreamObj : /Length key not found");
+        return false;
+    }
+    if (len_obj->type==PDF_OBJ_INDIRECT_REF){
+        len_obj = xref->getLengthObject(f, len_obj->indirect.major, tmp_len);
+    }
+    if (!isInt(len_obj)){
+        debug("StreamObj : invalid stream length obj type %d",
+                    len_obj ? len_obj->type : PDF_OBJ_UNKNOWN);
+        return false;
+    }
+    if (len_obj->integer < 0){
+        debug("StreamObj : negative stream length");
+        return false;
+    }
+    off_t stream_len = len_obj->integer;
+    stream->dict.deleteItem(NAME_Length);
+    // read stream after the newline
+    switch (mygetc(f)){
+        case EOF:
+            return false;
+        case CHAR_CR:
+            if (mygetc(f)!=CHAR_LF){
+                myungetc(f);
             }
-            debug("unknown id '%s'", last_tok->id);
+        case CHAR_LF:
+            break;
+        default:
+            myungetc(f);
+            break;
+    }
+    stream->begin = myftell(f);
+read_stream:
+    stream->len = stream_len;
+    // f may be the input file or a MYFILE sharing its buffer
+    if (xref!=NULL && xref->file!=NULL && f->buf==xref->file->buf){
+        // do not read stream data, only skip it. it will be loaded when required
+        if (myfseek(f, stream->begin + stream_len, SEEK_SET)!=0){
+            message(WARN,"failed to read stream data of size %lld at pos %lld",
+                    (long long)stream_len, (long long)stream->begin);
+            stream->len = 0;
             return false;
         }
-        case TOK_EOF:
-        case TOK_EARRAY:
-        case TOK_EDICT:
-        case TOK_UNKNOWN:
-        default:
+        stream->file = xref->file;
+    }
+    else if (stream_len){
+        stream->stream = (char*) malloc(stream_len);
+        if (stream->stream==NULL){
+            message(WARN,"StreamObj : failed to allocate memory of size %lld", (long long)stream_len);
+            stream->len = 0;
+            return false;
+        }
+        if (myfread(stream->stream,1,stream_len,f)!=(size_t)stream_len){
+            message(WARN,"failed to read stream data of size %lld at pos %lld",
+                    (long long)stream_len, (long long)stream->begin);
+            stream->len = 0;
             return false;
         }
     }
-    return false;
+
+    if (not lex.get()
+        || lex.tok().type!=TOK_ID
+        || !lex.tok().is("endstream"))// may be wrong stream Length
+    {
+        stream_len = get_correct_stream_len(f, stream->begin);
+        if (stream_len == -1){
+            debug("StreamObj : endstream keyword not found");
+            return false;
+        }
+        debug("StreamObj : fixing wrong value of stream length");
+        if (stream->stream){
+            free(stream->stream);
+            stream->stream = NULL;
+        }
+        assert(myfseek(f, stream->begin, SEEK_SET)==0);
+        goto read_stream;
+    }
+    return true;
 }
 
 int
-PdfObject:: write (FILE * f)
+PdfObject:: write (OutFile *f)
 {
-    int ret_val = -1;
-
     switch (this->type)
     {
     case PDF_OBJ_BOOL:
         if (this->boolean){
-            ret_val = fprintf(f, "true");
+            f->write("true", 4);
         }
         else {
-            ret_val = fprintf(f, "false");
+            f->write("false", 5);
         }
-        return ret_val<0?ret_val:0;
+        return 0;
     case PDF_OBJ_INT:
-        ret_val = fprintf(f, "%d", this->integer);
-        return ret_val<0?ret_val:0;
+        f->putInt(this->integer);
+        return 0;
     case PDF_OBJ_REAL:
-    {
-        ret_val = fprintf(f, "%s", double2str(this->real).c_str());
-        return ret_val<0?ret_val:0;
-    }
+        f->putReal(this->real);
+        return 0;
     case PDF_OBJ_STR:
-        ret_val = fwrite(this->str.data, this->str.len, 1, f);
-        return ret_val<0?ret_val:0;
+        f->write(this->str->data, this->str->len);
+        return 0;
     case PDF_OBJ_NAME:
-        ret_val = fprintf(f, "/%s", this->name);
-        return ret_val<0?ret_val:0;
+        f->putChar('/');
+        f->putStr(atom_name(this->name));
+        return 0;
     case PDF_OBJ_ARRAY:
         return this->array->write(f);
     case PDF_OBJ_DICT:
@@ -609,15 +1118,13 @@ PdfObject:: write (FILE * f)
     case PDF_OBJ_STREAM:
         return this->stream->write(f);
     case PDF_OBJ_NULL:
-        fprintf(f, "null");
-        return 0;
-    case PDF_OBJ_INDIRECT:
-        fprintf(f, "%d %d obj\n", this->indirect.major, this->indirect.minor);
-        this->indirect.obj->write(f);
-        fprintf(f, "\nendobj\n");
+        f->write("null", 4);
         return 0;
     case PDF_OBJ_INDIRECT_REF:
-        fprintf(f, "%d %d R", this->indirect.major, this->indirect.minor);
+        f->putInt(this->indirect.major);
+        f->putChar(' ');
+        f->putInt(this->indirect.minor);
+        f->write(" R", 2);
         return 0;
     default:
         assert(0);
@@ -626,69 +1133,75 @@ PdfObject:: write (FILE * f)
 }
 
 int
-PdfObject:: copyFrom (PdfObject *src_obj){
-    // create deep copy of all objects
-    this->setType(src_obj->type);
-    switch (src_obj->type){
-        case PDF_OBJ_BOOL:
-            this->boolean = src_obj->boolean;
-            return true;
-        case PDF_OBJ_INT:
-            this->integer = src_obj->integer;
-            return true;
-        case PDF_OBJ_REAL:
-            this->real = src_obj->real;
-            return true;
-        case PDF_OBJ_STR:
-            str.len = src_obj->str.len;
-            str.data = (char*) malloc2( str.len+1);
-            memcpy(str.data, src_obj->str.data, str.len+1);
-            return true;
-        case PDF_OBJ_NAME:
-            this->name = strdup(src_obj->name);
-            assert(this->name!=NULL);
-            return true;
-        case PDF_OBJ_ARRAY:
-            for (PdfObject *item : *src_obj->array){
-                PdfObject *new_item = new PdfObject();
-                new_item->copyFrom(item);
-                this->array->append(new_item);
-            }
-            return true;
-        case PDF_OBJ_DICT:
-            for (auto it : *src_obj->dict){
-                PdfObject *new_obj = new PdfObject();
-                new_obj->copyFrom(it.second);
-                this->dict->add(it.first, new_obj);
-            }
-            return true;
-        case PDF_OBJ_STREAM:
-            this->stream->len = src_obj->stream->len;
-            // copy stream dictionary recursively
-            for (auto it : src_obj->stream->dict){
-                PdfObject *new_obj = new PdfObject();
-                new_obj->copyFrom(it.second);
-                this->stream->dict.add(it.first, new_obj);
-            }
-            if (src_obj->stream->len){
-                this->stream->stream = (char*) malloc2(src_obj->stream->len);
-                memcpy(this->stream->stream, src_obj->stream->stream, src_obj->stream->len);
-            }
-            return true;
-        case PDF_OBJ_INDIRECT:
-            this->indirect.major = src_obj->indirect.major;
-            this->indirect.minor = src_obj->indirect.minor;
-            this->indirect.obj = new PdfObject();
-            this->indirect.obj->copyFrom(src_obj->indirect.obj);
-            return true;
-         case PDF_OBJ_INDIRECT_REF:
-            this->indirect.major = src_obj->indirect.major;
-            this->indirect.minor = src_obj->indirect.minor;
-            return true;
-        case PDF_OBJ_NULL:
-            return true;
-        default:
-            assert(0);
+PdfObject:: copyFrom (PdfObject *src_obj)
+{
+    // create deep copy of all objects. items of containers are copied using
+    // a stack of (copy, source) pairs instead of recursion
+    std::vector<std::pair<PdfObject*, PdfObject*> > stack;
+    stack.push_back(std::make_pair(this, src_obj));
+    while (not stack.empty()) {
+        PdfObject *dst = stack.back().first;
+        PdfObject *src = stack.back().second;
+        stack.pop_back();
+        dst->setType(src->type);
+        switch (src->type){
+            case PDF_OBJ_BOOL:
+                dst->boolean = src->boolean;
+                break;
+            case PDF_OBJ_INT:
+                dst->integer = src->integer;
+                break;
+            case PDF_OBJ_REAL:
+                dst->real = src->real;
+                break;
+            case PDF_OBJ_STR:
+                dst->str = new_string(src->str->data, src->str->len);
+                break;
+            case PDF_OBJ_NAME:
+                dst->name = src->name;
+                break;
+            case PDF_OBJ_ARRAY:
+                // add all items first, as adding items may move previous items
+                for (int i=0; i<src->array->count(); i++){
+                    dst->array->newItem();
+                }
+                for (int i=0; i<src->array->count(); i++){
+                    stack.push_back(std::make_pair(dst->array->at(i), src->array->at(i)));
+                }
+                break;
+            case PDF_OBJ_DICT:
+                for (auto it : *src->dict){
+                    PdfObject *new_obj = new PdfObject();
+                    dst->dict->add(it.first, new_obj);
+                    stack.push_back(std::make_pair(new_obj, it.second));
+                }
+                break;
+            case PDF_OBJ_STREAM:
+                dst->stream->len = src->stream->len;
+                dst->stream->begin = src->stream->begin;
+                dst->stream->file = src->stream->file;
+                // copy stream dictionary
+                for (auto it : src->stream->dict){
+                    PdfObject *new_obj = new PdfObject();
+                    dst->stream->dict.add(it.first, new_obj);
+                    stack.push_back(std::make_pair(new_obj, it.second));
+                }
+                // if data is not loaded, the copy also refers to the input file.
+                // loaded data is shared in chunks, until one of the streams modifies it
+                if (src->stream->chunks || src->stream->stream){
+                    dst->stream->len = 0;
+                    dst->stream->append(src->stream);
+                }
+                break;
+            case PDF_OBJ_INDIRECT_REF:
+                dst->indirect.major = src->indirect.major;
+                dst->indirect.minor = src->indirect.minor;
+                break;
+            case PDF_OBJ_NULL:
+                break;
+            default:
+                assert(0);
+        }
     }
     return true;
 }
@@ -697,12 +1210,6 @@ void PdfObject:: clear()
 {
     switch (type)
     {
-    case PDF_OBJ_STR:
-        free(str.data);
-        break;
-    case PDF_OBJ_NAME:
-        free(name);
-        break;
     case PDF_OBJ_ARRAY:
         array->deleteItems();
         delete array;
@@ -714,9 +1221,6 @@ void PdfObject:: clear()
     case PDF_OBJ_STREAM:
         delete stream;
         break;
-    case PDF_OBJ_INDIRECT:
-        delete indirect.obj;
-        break;
     default:
         break;
     }
@@ -728,7 +1232,44 @@ PdfObject:: ~PdfObject() {
 }
 
 
+// *********** ------------- Object Walker ----------------- ***********
+PdfObject* ObjectWalker:: next()
+{
+    if (stack.empty())
+        return NULL;
+    PdfObject *obj = stack.back();
+    stack.pop_back();
+    // items are pushed in reverse order, so that they are visited in order
+    DictObj *dict = NULL;
+    switch (obj->type){
+        case PDF_OBJ_ARRAY:
+            for (int i=obj->array->count()-1; i>=0; i--){
+                stack.push_back(obj->array->at(i));
+            }
+            break;
+        case PDF_OBJ_DICT:
+            dict = obj->dict;
+            break;
+        case PDF_OBJ_STREAM:
+            dict = &obj->stream->dict;
+            break;
+        default:
+            break;
+    }
+    if (dict) {
+        for (int i=dict->len-1; i>=0; i--){
+            stack.push_back(dict->items[i].second);
+        }
+    }
+    return obj;
+}
+
+
 // *********** -------------- Pdf ObjectTable ----------------- ***********
+ObjectTable:: ObjectTable() {
+    file = NULL;
+}
+
 int
 ObjectTable:: count() {
     return table.size();
@@ -750,22 +1291,9 @@ ObjectTable:: readObject(MYFILE *f, int major)
     // read object if nonfree object
     if (table[major].type==NONFREE_OBJ)
     {
-        int offset = table[major].offset;
-        // some bad xref table may have offset==0, or offset > file size
-        if (offset==0 or myfseek(f, offset, SEEK_SET)){
-            debug("object %d : invalid offset %d", major, offset);
-            goto fail;
-        }
-        PdfObject obj;
-        if (!obj.read(f, this, NULL) or obj.type!=PDF_OBJ_INDIRECT){
-            debug("object %d : failed to parse object", major);
+        table[major].obj = parseObject(f, major);
+        if (table[major].obj==NULL)
             goto fail;
-        }
-        if (obj.indirect.major!=major || obj.indirect.minor!=table[major].minor){
-            debug("object %d : mismatched obj_no %d or gen_no %d", obj.indirect.major, obj.indirect.minor);
-        }
-        table[major].obj = obj.indirect.obj;
-        obj.type = PDF_OBJ_UNKNOWN;// this is to prevent obj.indirect.obj from being deleted
     }
     // read object if compressed nonfree object
     else if (table[major].type==COMPRESSED_OBJ) {
@@ -776,37 +1304,20 @@ ObjectTable:: readObject(MYFILE *f, int major)
             debug("object %d : invalid source obj stream %d", major, obj_stm_no);
             goto fail;
         }
-        StreamObj *obj_stm = table[obj_stm_no].obj->stream;
-        if (not obj_stm->decompress())
+        std::vector<int> members;
+        if (not readObjectStream(table[obj_stm_no].obj->stream, obj_stm_no, members))
             goto fail;
-        int n = obj_stm->dict["N"]->integer; // number of objects in this stream
-        int first = obj_stm->dict["First"]->integer;// offset of first member inside stream
-        // open stream as file, parse and get all objects inside it
-        // stream contains : obj_no1 offset1 obj_no2 offset2 ... obj_1 obj2 ...
-        MYFILE *file = streamopen(obj_stm->stream, obj_stm->len);
-        Token tok;
-        for (int i=0; i<n; i++) {
-            tok.get(file);
-            int obj_no = tok.integer;
-            tok.get(file);
-            int offset = first + tok.integer;
-            if (table[obj_no].obj_stm != obj_stm_no)// the object table says,
-                continue;   // this obj no is stored in another stream
-            size_t last_seek = myftell(file);
-            myfseek(file, offset, SEEK_SET);
-            PdfObject *new_obj = new PdfObject();
-            if (not new_obj->read(file, this, NULL)){
-                debug("compressed obj %d : failed to read", obj_no);
-                new_obj->type = PDF_OBJ_NULL;
-            }
-            table[obj_no].obj = new_obj;
-            myfseek(file, last_seek, SEEK_SET);
+        for (int obj_no : members) {
+            table[obj_no].type = NONFREE_OBJ;
         }
-        myfclose(file);
         // the object stream is no longer required, as we have loaded all objects inside it
         delete table[obj_stm_no].obj;
         table[obj_stm_no].obj = NULL;
         table[obj_stm_no].type = FREE_OBJ;
+        if (table[major].obj==NULL) {
+            debug("object %d : not found in obj stream %d", major, obj_stm_no);
+            table[major].type = FREE_OBJ;
+        }
     }
     return true;
 fail:
@@ -815,25 +1326,177 @@ fail:
     return false;
 }
 
+// parse a nonfree object at its offset. The table is not modified, so this can be
+// called from multiple threads, each having its own MYFILE. returns NULL on failure
+PdfObject*
+ObjectTable:: parseObject(MYFILE *f, int major)
+{
+    off_t offset = table[major].offset;
+    // some bad xref table may have offset==0, or offset > file size
+    if (offset==0 or myfseek(f, offset, SEEK_SET)){
+        debug("object %d : invalid offset %lld", major, (long long)offset);
+        return NULL;
+    }
+    PdfObject *new_obj = new PdfObject();
+    IndirectObj obj_id;
+    if (!new_obj->read(f, this, &obj_id) or obj_id.major<0){
+        debug("object %d : failed to parse object", major);
+        delete new_obj;
+        return NULL;
+    }
+    if (obj_id.major!=major || obj_id.minor!=table[major].minor){
+        debug("object %d : mismatched obj_no %d or gen_no %d", major, obj_id.major, obj_id.minor);
+    }
+    return new_obj;
+}
+
+// decompress object stream and parse all objects which are stored in this stream
+// according to the table. Only the obj of those table items are set, and their
+// numbers are added to members. So different object streams can be read at a time.
+bool
+ObjectTable:: readObjectStream(StreamObj *obj_stm, int obj_stm_no, std::vector<int> &members)
+{
+    if (not obj_stm->decompress())
+        return false;
+    PdfObject *n_obj = obj_stm->dict[NAME_N];
+    PdfObject *first_obj = obj_stm->dict[NAME_First];
+    if (!isInt(n_obj) || !isInt(first_obj)){
+        debug("obj stream %d : N or First is missing", obj_stm_no);
+        return false;
+    }
+    int n = n_obj->integer; // number of objects in this stream
+    int first = first_obj->integer;// offset of first member inside stream
+    // open stream as file, parse and get all objects inside it
+    // stream contains : obj_no1 offset1 obj_no2 offset2 ... obj_1 obj2 ...
+    MYFILE *file = streamopen(obj_stm->stream, obj_stm->len);
+    if (file==NULL)
+        return false;
+    Token tok;
+    for (int i=0; i<n; i++) {
+        tok.get(file);
+        int obj_no = tok.integer;
+        tok.get(file);
+        int offset = first + tok.integer;
+        if (obj_no<=0 || obj_no>=(int)table.size())
+            continue;
+        if (table[obj_no].type!=COMPRESSED_OBJ || table[obj_no].obj_stm != obj_stm_no
+                || table[obj_no].obj!=NULL)
+            continue;// the object table says, this obj no is stored in another stream
+        off_t last_seek = myftell(file);
+        myfseek(file, offset, SEEK_SET);
+        PdfObject *new_obj = new PdfObject();
+        if (not new_obj->read(file, this)){
+            debug("compressed obj %d : failed to read", obj_no);
+            new_obj->type = PDF_OBJ_NULL;
+        }
+        table[obj_no].obj = new_obj;
+        members.push_back(obj_no);
+        myfseek(file, last_seek, SEEK_SET);
+    }
+    myfclose(file);
+    return true;
+}
+
+// get the object that stores stream length. If the object is not loaded in table,
+// it is read in tmp_obj, so table is not modified while loading objects in parallel
+PdfObject*
+ObjectTable:: getLengthObject(MYFILE *f, int major, PdfObject &tmp_obj)
+{
+    if (major<=0 || major>=(int)table.size())
+        return NULL;
+    if (table[major].obj!=NULL)
+        return table[major].obj;
+
+    PdfObject *len_obj = NULL;
+    off_t fpos = myftell(f);
+    if (table[major].type==NONFREE_OBJ){
+        IndirectObj obj_id;
+        if (myfseek(f, table[major].offset, SEEK_SET)==0 && tmp_obj.read(f, this, &obj_id)
+                && obj_id.major>=0)
+            len_obj = &tmp_obj;
+    }
+    else if (table[major].type==COMPRESSED_OBJ){
+        // compressed objects are loaded before nonfree objects in parallel loading,
+        // so this happens only when objects are read one by one
+        readObject(f, major);
+        len_obj = table[major].obj;
+    }
+    myfseek(f, fpos, SEEK_SET);
+    return len_obj;
+}
+
 // read all objects after loading xref table
 void ObjectTable:: readObjects(MYFILE *f)
 {
-    // at first load nonfree objects and then decompress object streams
+    int n_threads = thread_count();
+    // objects can be parsed in parallel only when whole file is in memory
+    if (n_threads<=1 || f->f!=NULL){
+        // at first load nonfree objects and then decompress object streams
+        for (size_t i=1; i<table.size(); ++i) {
+            switch (table[i].type) {
+                case FREE_OBJ:
+                    break;
+                case NONFREE_OBJ:
+                case COMPRESSED_OBJ:
+                    readObject(f, i);
+                    break;
+                default:
+                    debug("obj_table item %d : invalid obj type", i);
+            }
+        }
+        return;
+    }
+    // object streams are decompressed and parsed at first, each stream in a separate task.
+    std::vector<int> obj_stms;
+    for (size_t i=1; i<table.size(); ++i) {
+        if (table[i].type==COMPRESSED_OBJ && table[i].obj==NULL) {
+            int obj_stm_no = table[i].obj_stm;
+            if (obj_stm_no>0 && obj_stm_no<(int)table.size()
+                    && table[obj_stm_no].type==NONFREE_OBJ && table[obj_stm_no].obj==NULL){
+                readObject(f, obj_stm_no);// only stream dict is parsed here
+                if (isStream(table[obj_stm_no].obj))
+                    obj_stms.push_back(obj_stm_no);
+            }
+        }
+    }
+    std::vector<std::vector<int>> members(obj_stms.size());
+    std::vector<char> stm_ok(obj_stms.size(), 0);
+    parallel_for(obj_stms.size(), n_threads, NULL, arena, [&](size_t i, MYFILE*) {
+        stm_ok[i] = readObjectStream(table[obj_stms[i]].obj->stream, obj_stms[i], members[i]);
+    });
+    for (size_t i=0; i<obj_stms.size(); i++) {
+        for (int obj_no : members[i]) {
+            table[obj_no].type = NONFREE_OBJ;
+        }
+        if (not stm_ok[i])
+            continue;// members will be set null objects below
+        delete table[obj_stms[i]].obj;
+        table[obj_stms[i]].obj = NULL;
+        table[obj_stms[i]].type = FREE_OBJ;
+    }
+    // read remaining (possibly broken) compressed objects, so that no compressed object
+    // will have to be loaded while parsing nonfree objects in parallel
     for (size_t i=1; i<table.size(); ++i) {
-        //message(LOG, "reading obj %d, type %d", i, xref->table[i].type);
-        switch (table[i].type) {
-            case FREE_OBJ:
-                break;
-            case NONFREE_OBJ:
-                readObject(f, i);
-                break;
-            case COMPRESSED_OBJ:
-                readObject(f, i);// here obj has been decompressed and read
-                table[i].type = NONFREE_OBJ;
-                break;
-            default:
-                debug("obj_table item %d : invalid obj type", i);
+        if (table[i].type==COMPRESSED_OBJ)
+            readObject(f, i);
+    }
+    // then nonfree objects are parsed by worker threads, each reading its own MYFILE.
+    // parsed objects are put in table after all threads are finished.
+    std::vector<int> objs;
+    for (size_t i=1; i<table.size(); ++i) {
+        if (table[i].type==NONFREE_OBJ && table[i].obj==NULL)
+            objs.push_back(i);
+    }
+    std::vector<PdfObject*> parsed(objs.size(), NULL);
+    parallel_for(objs.size(), n_threads, f, arena, [&](size_t i, MYFILE *view) {
+        parsed[i] = parseObject(view, objs[i]);
+    });
+    for (size_t i=0; i<objs.size(); i++) {
+        if (parsed[i]==NULL){
+            parsed[i] = new PdfObject();
+            parsed[i]->type = PDF_OBJ_NULL;
         }
+        table[objs[i]].obj = parsed[i];
     }
 }
 
@@ -841,7 +1504,7 @@ int getXrefType(MYFILE *f)
 {
     char line[LLEN];
     skipspace(f);
-    long fpos = myftell(f);
+    off_t fpos = myftell(f);
     if (myfgets(line, LLEN, f)==NULL){
         return XREF_INVALID;
     }
@@ -857,16 +1520,57 @@ int getXrefType(MYFILE *f)
         myfseek(f, fpos, SEEK_SET);
         return XREF_STREAM;
     }
-    tok.freeData();
     return XREF_INVALID;
 }
 
-bool ObjectTable:: read (MYFILE *f, size_t xref_pos)
+static inline void set_xref_entry(ObjectTableItem *elm, int major, off_t offset, int gen, char type)
+{
+    if (elm->type==0){ // skip if already set by next xreftable
+        elm->major = major;
+        elm->type = type=='f'? FREE_OBJ : NONFREE_OBJ;
+        elm->offset = offset;
+        elm->minor = gen;
+    }
+}
+
+/* Read entries of a xref subsection directly from buffer, each entry is exactly
+  20 bytes "oooooooooo ggggg n" followed by " \n", " \r" or "\r\n". Stops at first
+  entry which is not in this format, or at end of buffer.
+  returns the number of entries read */
+static int read_xref_entries(MYFILE *f, ObjectTableItem *items, int major, int count)
+{
+    int n = 0;
+    const unsigned char *p = f->ptr;
+    for (; n<count && f->end-p >= XREF_ENT_LEN+2; n++, p+=XREF_ENT_LEN+2) {
+        off_t offset = 0;
+        int gen = 0;
+        bool ok = p[10]==' ' && p[16]==' ' && (p[17]=='n' || p[17]=='f')
+                && ((p[18]==' ' && (p[19]=='\n' || p[19]=='\r')) || (p[18]=='\r' && p[19]=='\n'));
+        for (int i=0; i<10; i++) {
+            unsigned digit = p[i]-'0';
+            ok = ok && digit<10;
+            offset = offset*10 + digit;
+        }
+        for (int i=11; i<16; i++) {
+            unsigned digit = p[i]-'0';
+            ok = ok && digit<10;
+            gen = gen*10 + digit;
+        }
+        if (not ok)
+            break;
+        set_xref_entry(items+n, major+n, offset, gen, p[17]);
+    }
+    f->ptr = (unsigned char*) p;
+    return n;
+}
+
+/* Entries in standard format are read by read_xref_entries(). The irregular
+  entries (eg. with extra spaces or a single char newline) are read line by line */
+bool ObjectTable:: read (MYFILE *f, off_t xref_pos)
 {
-    size_t pos=0;
+    off_t pos=0;
     int len=0, object_id=0, object_count=0;
     char line[LLEN];
-    ObjectTableItem *elm;
 
     if (myfseek(f, xref_pos, SEEK_SET)==-1){
         return false;
@@ -879,8 +1583,14 @@ bool ObjectTable:: read (MYFILE *f, size_t xref_pos)
     if (!starts(line, "xref")) {
         return false;
     }
-    //FILE *fd = fopen("xref", "wb");
-    while ((pos = myftell(f)) && myfgets(line,LLEN,f)!=NULL){
+    while (true) {
+        if (object_count>0){
+            int n = read_xref_entries(f, &table[object_id], object_id, object_count);
+            object_id += n;
+            object_count -= n;
+        }
+        if ((pos = myftell(f))==0 || myfgets(line,LLEN,f)==NULL)
+            break;
         char *entry = line;
         while (isspace(*entry)) // fixes for leading spaces in xref table
             entry++;
@@ -891,25 +1601,20 @@ bool ObjectTable:: read (MYFILE *f, size_t xref_pos)
             --len;
         }
         if (strlen(entry)==XREF_ENT_LEN){
-            int field1, field2;
+            long long field1;
+            int field2;
             char obj_type;
-            if (sscanf(entry,"%d %d %c", &field1, &field2, &obj_type)!=3){
+            if (object_count<=0 || sscanf(entry,"%lld %d %c", &field1, &field2, &obj_type)!=3){
                 break;
             }
-            //fprintf(fd, "%s\n", entry);
-            elm = &(this->table[object_id]);
-            if (elm->type==0){ // skip if already set by next xreftable
-                elm->major = object_id;
-                elm->type = obj_type=='f'? FREE_OBJ : NONFREE_OBJ;
-                elm->offset = field1;
-                elm->minor = field2;
-            }
+            set_xref_entry(&table[object_id], object_id, field1, field2, obj_type);
             object_id++;
             object_count--;
         }
         else {
             int object_begin_tmp, object_count_tmp;
-            if (sscanf(entry,"%d %d", &object_begin_tmp, &object_count_tmp)!=2){
+            if (sscanf(entry,"%d %d", &object_begin_tmp, &object_count_tmp)!=2
+                    || object_begin_tmp<0 || object_count_tmp<0){
                 myfseek(f, pos, SEEK_SET);// seek before trailer keyword
                 break;
             }
@@ -918,7 +1623,6 @@ bool ObjectTable:: read (MYFILE *f, size_t xref_pos)
             this->expandToFit(object_begin_tmp + object_count);
         }
     }
-    //fclose(fd);
     if (object_count!=0){
         return false;
     }
@@ -932,74 +1636,144 @@ bool ObjectTable:: read (MYFILE *f, size_t xref_pos)
     return true;
 }
 
+// read a big endian integer of W bytes. W is known at compile time, so the loop is unrolled
+template <int W>
+static inline uint64_t load_be(const unsigned char *p)
+{
+    uint64_t val = 0;
+    for (int i=0; i<W; i++)
+        val = (val<<8) | p[i];
+    return val;
+}
+
+static inline void set_xref_stream_entry(ObjectTableItem *elm, int major, int type,
+                                         uint64_t field2, uint64_t field3)
+{
+    if (elm->type!=FREE_OBJ)//skip when already set by next xref table
+        return;
+    elm->major = major;
+    elm->type = type;
+    switch (type) {
+    case FREE_OBJ:
+        elm->next_free = field2;
+        elm->minor = field3;
+        break;
+    case NONFREE_OBJ:
+        elm->offset = field2;
+        elm->minor = field3;
+        break;
+    case COMPRESSED_OBJ:
+        elm->obj_stm = field2;// minor=0
+        elm->index = field3;
+        break;
+    default:
+        break;
+    }
+}
+
+// decode count rows of xref stream, where field widths are W0, W1 and W2 bytes
+template <int W0, int W1, int W2>
+static void decode_xref_rows(const unsigned char *row, const int *w, ObjectTableItem *items, int major, int count)
+{
+    for (int n=0; n<count; n++, row+=W0+W1+W2) {
+        int type = W0 ? load_be<W0>(row) : 1;// this field may be absent
+        set_xref_stream_entry(items+n, major+n, type, load_be<W1>(row+W0), load_be<W2>(row+W0+W1));
+    }
+}
+
+// for the uncommon field widths
+static void decode_xref_rows_any(const unsigned char *row, const int *w, ObjectTableItem *items, int major, int count)
+{
+    const char *p = (const char*) row;
+    for (int n=0; n<count; n++, p+=w[0]+w[1]+w[2]) {
+        int type = w[0] ? arr2int(p, w[0]) : 1;
+        set_xref_stream_entry(items+n, major+n, type, arr2int(p+w[0], w[1]), arr2int(p+w[0]+w[1], w[2]));
+    }
+}
+
+typedef void (*XrefRowDecoder)(const unsigned char *row, const int *w, ObjectTableItem *items, int major, int count);
+
+static XrefRowDecoder get_xref_row_decoder(const int *w)
+{
+    // each width is atmost 8, so it fits in 4 bits
+    switch (w[0]<<8 | w[1]<<4 | w[2]) {
+    case 0x121: return decode_xref_rows<1,2,1>;
+    case 0x122: return decode_xref_rows<1,2,2>;
+    case 0x131: return decode_xref_rows<1,3,1>;
+    case 0x132: return decode_xref_rows<1,3,2>;
+    case 0x141: return decode_xref_rows<1,4,1>;
+    case 0x142: return decode_xref_rows<1,4,2>;
+    case 0x151: return decode_xref_rows<1,5,1>;
+    case 0x152: return decode_xref_rows<1,5,2>;
+    case 0x181: return decode_xref_rows<1,8,1>;
+    case 0x182: return decode_xref_rows<1,8,2>;
+    default:    return decode_xref_rows_any;
+    }
+}
+
 // from PDF 1.5 the xreftable can be a stream in an indirect object.
 // the dictionary of stream is the trailer dictionary.
 // essential keys : Type, Size and W . Optional keys : Index, Prev
 bool ObjectTable:: read (PdfObject *stream, PdfObject *p_trailer)
 {
-    //FILE *fd;
-    //fd = fopen("xref", "wb");
     if (not stream->stream->decompress())
         return false;
+    PdfObject *size_obj = p_trailer->dict->get(NAME_Size);
+    PdfObject *w_arr_obj = p_trailer->dict->get(NAME_W);
+    if (not isInt(size_obj) || not isArray(w_arr_obj) || w_arr_obj->array->count()<3){
+        message(WARN, "xref stream : /Size or /W is missing");
+        return false;
+    }
     // table_size is the max object number + 1
-    int table_size = p_trailer->dict->get("Size")->integer;
+    int table_size = size_obj->integer;
     this->expandToFit(table_size);
     // split stream into table, W parameter is array of length 3
-    ArrayObj *w_arr_obj = p_trailer->dict->get("W")->array;
     int w_arr[3];
     for (int i=0; i<3; ++i) {
-        w_arr[i] = w_arr_obj->at(i)->integer;
+        w_arr[i] = w_arr_obj->array->at(i)->integer;
+        if (w_arr[i]<0 || w_arr[i]>8){// fields larger than 64 bit are not supported
+            message(WARN, "xref stream : invalid /W field width %d", w_arr[i]);
+            return false;
+        }
     }
     int row_len = w_arr[0] + w_arr[1] + w_arr[2];
-    // Index is array of pairs of integers. Each pair has obj number and obj count
-    PdfObject *index = p_trailer->dict->get("Index");
-    if (index==NULL) {
-        index = new PdfObject();
-        char s[24];
-        snprintf(s, 23, "[ 0 %d ]", table_size);
-        assert( index->readFromString(s) );
-        p_trailer->dict->add("Index", index);
-    }
-    auto item = index->array->begin();
-    for (int i=0; item != index->array->end(); item++) {
-        int first = (*item)->integer;
-        item++;
-        int count = (*item)->integer;
-        for (int major=first; major<first+count; major++) {
-            if (this->table[major].type!=FREE_OBJ){//skip when already set by next xref table
-                i+=row_len;
-                continue;
-            }
-            char *row = stream->stream->stream + i;
-            int field1 = w_arr[0] ? arr2int(row, w_arr[0]) : 1;// this field may be absent
-            int field2 = arr2int(row+w_arr[0], w_arr[1]);
-            int field3 = w_arr[2] ? arr2int(row+w_arr[0]+w_arr[1], w_arr[2]) : 0;
-            //fprintf(fd, "%d %d %d %d\n", major, field1, field2, field3);
-            ObjectTableItem *elm = &(this->table[major]);
-            elm->major = major;
-            elm->type = field1;
-            switch (field1) {
-            case FREE_OBJ:
-                elm->next_free = field2;
-                elm->minor = field3;
-                break;
-            case NONFREE_OBJ:
-                elm->offset = field2;
-                elm->minor = field3;
-                break;
-            case COMPRESSED_OBJ:
-                elm->obj_stm = field2;// minor=0
-                elm->index = field3;
-                break;
-            default:
-                break;
+    if (row_len==0){
+        message(WARN, "xref stream : invalid /W field width 0");
+        return false;
+    }
+    XrefRowDecoder decode_rows = get_xref_row_decoder(w_arr);
+    const unsigned char *row = (const unsigned char*) stream->stream->stream;
+    size_t rows_left = stream->stream->len / row_len;
+    // Index is array of pairs of integers. Each pair has obj number and obj count.
+    // if Index is absent, it is [ 0 Size ]
+    PdfObject *index = p_trailer->dict->get(NAME_Index);
+    int index_len = isArray(index) ? index->array->count() : 2;
+    for (int i=0; i+1<index_len; i+=2) {
+        int64_t first=0, count=table_size;
+        if (isArray(index)){
+            PdfObject *first_obj = index->array->at(i);
+            PdfObject *count_obj = index->array->at(i+1);
+            if (not isInt(first_obj) || not isInt(count_obj)){
+                message(WARN, "xref stream : /Index contains non integer item");
+                return false;
             }
-            i += row_len;
+            first = first_obj->integer;
+            count = count_obj->integer;
         }
+        if (first<0 || count<0 || first+count > INT_MAX){
+            message(WARN, "xref stream : invalid subsection in /Index");
+            return false;
+        }
+        if ((size_t)count > rows_left){
+            debug("xref stream : stream data is shorter than /Index");
+            count = rows_left;
+        }
+        this->expandToFit(first + count);
+        decode_rows(row, w_arr, &table[first], first, count);
+        row += count*row_len;
+        rows_left -= count;
     }
-    //fflush(fd);
-    //fclose(fd);
-    if (table[0].type!=FREE_OBJ){//in some bad xref tables
+    if (table.size()>0 and table[0].type!=FREE_OBJ){//in some bad xref tables
         debug("obj no 0 is not free");
         table[0].type = FREE_OBJ;
         table[0].minor = 65535;
@@ -1008,12 +1782,43 @@ bool ObjectTable:: read (PdfObject *stream, PdfObject *p_trailer)
     return true;
 }
 
-int ObjectTable:: addObject (PdfObject *obj)
+static thread_local SlotScope *cur_slots = NULL;
+
+SlotScope:: SlotScope(ObjectTable *obj_table, int begin, int end_slot)
+{
+    table = obj_table;
+    next = begin;
+    end = end_slot;
+    prev = cur_slots;
+    cur_slots = this;
+}
+
+SlotScope:: ~SlotScope()
+{
+    cur_slots = prev;
+}
+
+// add count free items at the end of table, returns index of first item
+int ObjectTable:: reserveSlots (int count)
 {
     int major = table.size();
-    ObjectTableItem item = {NULL,0,0,0,0,0,0};
-    table.resize(major+1, item);
+    expandToFit(major + count);
+    return major;
+}
 
+int ObjectTable:: addObject (PdfObject *obj)
+{
+    int major;
+    if (cur_slots!=NULL && cur_slots->table==this) {
+        if (cur_slots->next >= cur_slots->end)
+            message(FATAL, "ObjectTable : no free slot left for new object");
+        major = cur_slots->next++;
+    }
+    else {
+        major = table.size();
+        ObjectTableItem item = {NULL,0,0,0,0,0,0};
+        table.resize(major+1, item);
+    }
     table[major].major = major;
     table[major].type = NONFREE_OBJ;
     table[major].obj = obj;
@@ -1022,29 +1827,43 @@ int ObjectTable:: addObject (PdfObject *obj)
 
 PdfObject* ObjectTable:: getObject(int major, int minor)
 {
-    if (major<(int)table.size() && minor==table[major].minor)
-        return table[major].obj;
+    if (major>=0 && major<(int)table.size() && minor==table[major].minor)
+        return getObject(major);
     debug("warning : could not get object (%d,%d) from ObjectTable", major,minor);
     return NULL;
 }
 
-void ObjectTable:: writeObjects (FILE *f)
+// objects are read from file when they are accessed for the first time
+PdfObject* ObjectTable:: getObject(int major)
+{
+    if (major<0 || major>=(int)table.size()) {
+        debug("warning : could not get object %d from ObjectTable", major);
+        return NULL;
+    }
+    if (table[major].obj==NULL && table[major].type!=FREE_OBJ && file!=NULL) {
+        ArenaScope scope(&arena);
+        off_t fpos = myftell(file);
+        readObject(file, major);
+        myfseek(file, fpos, SEEK_SET);
+    }
+    return table[major].obj;
+}
+
+void ObjectTable:: writeObjects (OutFile *f)
 {
     for (size_t i=1; i<table.size(); ++i){
         switch (table[i].type){
             case FREE_OBJ:
+            case COMPRESSED_OBJ:// written inside object stream
                 continue;
             case NONFREE_OBJ:
-                table[i].offset = ftell(f);
-                if (fprintf(f,"%d %d obj\n", table[i].major, table[i].minor)<0){
-                    message(FATAL,"writeObjects() : I/O error");
-                }
-                if (table[i].obj->write(f)<0){
-                    message(FATAL,"writeObjects() : I/O error");
-                }
-                if (fprintf(f,"\nendobj\n")<0){
-                    message(FATAL,"writeObjects() : I/O error");
-                }
+                table[i].offset = f->tell();
+                f->putInt(table[i].major);
+                f->putChar(' ');
+                f->putInt(table[i].minor);
+                f->write(" obj\n", 5);
+                table[i].obj->write(f);
+                f->write("\nendobj\n", 8);
                 break;
             default:
                 assert(0);
@@ -1052,15 +1871,157 @@ void ObjectTable:: writeObjects (FILE *f)
     }
 }
 
-void ObjectTable:: writeXref (FILE *f)
+// put decimal digits of val in fixed width field, padded with leading zeros
+static void put_digits(char *field, uint64_t val, int width)
+{
+    for (int i=width-1; i>=0; i--) {
+        field[i] = '0' + val%10;
+        val /= 10;
+    }
+}
+
+void ObjectTable:: writeXref (OutFile *f)
 {
-    fprintf(f, "xref\n%d %d\n", 0, (int)table.size());
+    f->print("xref\n%d %d\n", 0, (int)table.size());
+    // each entry is "%010d %05d %c \n"
+    char entry[XREF_ENT_LEN+3] = "0000000000 00000 n \n";
     for (size_t i=0; i<table.size(); ++i){
-        char type = (table[i].type!=FREE_OBJ) ? 'n' : 'f';
-        if (fprintf(f,"%010d %05d %c \n", table[i].offset, table[i].minor, type)<0){
-            message(FATAL, "writeXref() : I/O error");
+        put_digits(entry, table[i].offset, 10);
+        put_digits(entry+11, table[i].minor, 5);
+        entry[17] = (table[i].type!=FREE_OBJ) ? 'n' : 'f';
+        f->write(entry, XREF_ENT_LEN+2);
+    }
+}
+
+// create a flate compressed object stream with given objects
+static PdfObject* createObjectStream(std::vector<ObjectTableItem*> &items)
+{
+    // objects are written in memory, then header is prepended with offsets
+    OutFile header(NULL), data(NULL);
+    for (ObjectTableItem *item : items) {
+        header.putInt(item->major);
+        header.putChar(' ');
+        header.putInt(data.tell());
+        header.putChar(' ');
+        item->obj->write(&data);
+        data.putChar('\n');
+    }
+    size_t header_len = header.tell();
+    size_t data_len = data.tell();
+    header.data()[header_len-1] = '\n';
+
+    PdfObject *obj = new PdfObject();
+    obj->setType(PDF_OBJ_STREAM);
+    StreamObj *stream = obj->stream;
+    stream->len = header_len + data_len;
+    stream->stream = (char*) malloc2(stream->len);
+    memcpy(stream->stream, header.data(), header_len);
+    memcpy(stream->stream+header_len, data.data(), data_len);
+
+    char *dict_str;
+    asprintf(&dict_str, "<< /Type /ObjStm /N %d /First %d >>", (int)items.size(), (int)header_len);
+    PdfObject dict;
+    dict.readFromString(dict_str);
+    free(dict_str);
+    stream->dict.merge(dict.dict);
+    stream->decompressed = true;
+    stream->compress(NAME_FlateDecode);
+    return obj;
+}
+
+// pack objects which are not streams in object streams (PDF 1.5).
+// the packed objects are written in object streams, not by writeObjects()
+void ObjectTable:: packObjects()
+{
+    std::vector<ObjectTableItem*> items;
+    int count = table.size();
+    for (int i=1; i<=count; ++i){
+        if (i<count) {
+            // objects with nonzero gen id and streams can not be stored in object stream
+            ObjectTableItem &item = table[i];
+            if (item.type!=NONFREE_OBJ || item.minor!=0 || item.obj->type==PDF_OBJ_STREAM)
+                continue;
+            items.push_back(&item);
+        }
+        if (items.size()==OBJSTM_MAX_OBJS || (i==count && items.size()>0)){
+            PdfObject *obj_stm = createObjectStream(items);
+            // addObject() may reallocate table, so use index instead of pointer
+            std::vector<int> majors;
+            for (ObjectTableItem *item : items) {
+                majors.push_back(item->major);
+            }
+            int obj_stm_no = addObject(obj_stm);
+            for (size_t j=0; j<majors.size(); j++) {
+                table[majors[j]].type = COMPRESSED_OBJ;
+                table[majors[j]].obj_stm = obj_stm_no;
+                table[majors[j]].index = j;
+            }
+            items.clear();
+        }
+    }
+}
+
+static DictFilter xref_stream_keys({NAME_Type, NAME_Size, NAME_Index, NAME_Prev, NAME_W, NAME_Length,
+                                    NAME_Filter, NAME_DecodeParms, NAME_XRefStm});
+
+// write cross reference stream (PDF 1.5) which also contains trailer dict
+void ObjectTable:: writeXrefStream (OutFile *f, PdfObject *trailer)
+{
+    PdfObject *obj = new PdfObject();
+    obj->setType(PDF_OBJ_STREAM);
+    int major = addObject(obj);
+    table[major].offset = f->tell();
+    // get required width of each field
+    uint64_t max_field2 = 0, max_field3 = 0;
+    for (ObjectTableItem &item : table) {
+        if (item.type==COMPRESSED_OBJ){
+            max_field2 = MAX(max_field2, (uint64_t)item.obj_stm);
+            max_field3 = MAX(max_field3, (uint64_t)item.index);
+        }
+        else {
+            if (item.type==NONFREE_OBJ)
+                max_field2 = MAX(max_field2, (uint64_t)item.offset);
+            max_field3 = MAX(max_field3, (uint64_t)item.minor);
+        }
+    }
+    int w[3] = {1, 1, 1};
+    while (w[1]<8 && (max_field2>>(8*w[1]))) w[1]++;
+    while (w[2]<8 && (max_field3>>(8*w[2]))) w[2]++;
+    int row_len = w[0] + w[1] + w[2];
+
+    StreamObj *stream = obj->stream;
+    stream->len = row_len * table.size();
+    stream->stream = (char*) malloc2(stream->len);
+    char *row = stream->stream;
+    for (ObjectTableItem &item : table) {
+        int2arr(item.type, row, w[0]);
+        if (item.type==COMPRESSED_OBJ){
+            int2arr(item.obj_stm, row+w[0], w[1]);
+            int2arr(item.index, row+w[0]+w[1], w[2]);
+        }
+        else {// offset of free object is 0
+            int2arr(item.type==FREE_OBJ ? 0 : item.offset, row+w[0], w[1]);
+            int2arr(item.minor, row+w[0]+w[1], w[2]);
         }
+        row += row_len;
     }
+    // in repair mode, trailer may contain keys of the input xref stream
+    for (auto it : *trailer->dict) {
+        if (not xref_stream_keys.count(it.first))
+            stream->dict.newItem(it.first)->copyFrom(it.second);
+    }
+    char *dict_str;
+    asprintf(&dict_str, "<< /Type /XRef /Size %d /W [ %d %d %d ] >>", (int)table.size(), w[0], w[1], w[2]);
+    PdfObject dict;
+    dict.readFromString(dict_str);
+    free(dict_str);
+    stream->dict.merge(dict.dict);
+    stream->decompressed = true;
+    stream->compress(NAME_FlateDecode);
+
+    f->print("%d 0 obj\n", major);
+    obj->write(f);
+    f->write("\nendobj\n", 8);
 }
 
 ObjectTableItem& ObjectTable:: operator[] (int index) {
@@ -1070,31 +2031,221 @@ ObjectTableItem& ObjectTable:: operator[] (int index) {
 
 // *********** ------------- Token Parser ----------------- ***********
 
-// unlike c_str() this is not null terminated string
-typedef struct {
-    char *buff;
-    size_t len;// content size
-    size_t buff_size;
-} mystring;
+/* The lexer spends most time in finding end of whitespace runs, names, keywords
+ and strings. With SSE2, 16 bytes are classified at a time. The scalar loops are
+ used for the last bytes of buffer, and when SSE2 is not available. */
+static inline bool is_whitespace(int c)
+{
+    switch (c){
+        case CHAR_FF:
+        case CHAR_SP:
+        case CHAR_TAB:
+        case CHAR_LF:
+        case CHAR_CR:
+            return true;
+    }
+    return false;
+}
 
-static mystring mystring_new()
+// delimiters and whitespace chars which end a name or keyword
+static inline bool is_delimiter(int c)
 {
-    mystring str = {NULL, 0, 16};
-    str.buff = (char*) malloc2(str.buff_size);
-    return str;
+    switch (c){
+        case '<':
+        case '>':
+        case '{':
+        case '}':
+        case '/':
+        case '%':
+        case '(':
+        case ')':
+        case '[':
+        case ']':
+            return true;
+    }
+    return is_whitespace(c);
+}
+
+#if (HAVE_SSE2)
+#define SSE_BYTE(c) _mm_set1_epi8(c)
+
+// bit i is set if byte i of v is whitespace
+static inline int sse_whitespace_mask(__m128i v)
+{
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, SSE_BYTE(CHAR_SP)), _mm_cmpeq_epi8(v, SSE_BYTE(CHAR_LF)));
+    ws = _mm_or_si128(ws, _mm_cmpeq_epi8(v, SSE_BYTE(CHAR_CR)));
+    ws = _mm_or_si128(ws, _mm_cmpeq_epi8(v, SSE_BYTE(CHAR_TAB)));
+    ws = _mm_or_si128(ws, _mm_cmpeq_epi8(v, SSE_BYTE(CHAR_FF)));
+    return _mm_movemask_epi8(ws);
+}
+
+// bit i is set if byte i of v is whitespace or delimiter
+static inline int sse_delimiter_mask(__m128i v)
+{
+    // pairs of delimiters differ by one bit, so one compare matches both
+    __m128i d = _mm_cmpeq_epi8(_mm_or_si128(v, SSE_BYTE(0x01)), SSE_BYTE(')'));// ( )
+    d = _mm_or_si128(d, _mm_cmpeq_epi8(_mm_or_si128(v, SSE_BYTE(0x02)), SSE_BYTE('>')));// < >
+    __m128i lower = _mm_or_si128(v, SSE_BYTE(0x20));
+    d = _mm_or_si128(d, _mm_cmpeq_epi8(lower, SSE_BYTE('{')));// [ {
+    d = _mm_or_si128(d, _mm_cmpeq_epi8(lower, SSE_BYTE('}')));// ] }
+    d = _mm_or_si128(d, _mm_cmpeq_epi8(v, SSE_BYTE('/')));
+    d = _mm_or_si128(d, _mm_cmpeq_epi8(v, SSE_BYTE('%')));
+    return _mm_movemask_epi8(d) | sse_whitespace_mask(v);
+}
+#endif
+
+static inline const unsigned char* skip_whitespace(const unsigned char *p, const unsigned char *end)
+{
+    // tokens are mostly separated by single space, so check first byte before loading 16 bytes
+    if (p<end && !is_whitespace(*p))
+        return p;
+#if (HAVE_SSE2)
+    while (end-p >= 16) {
+        int mask = ~sse_whitespace_mask(_mm_loadu_si128((const __m128i*)p)) & 0xffff;
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p<end && is_whitespace(*p))
+        p++;
+    return p;
+}
+
+// scanners return the position after last char of token, or NULL if token
+// continues after end of buffer
+static const unsigned char* scan_regular(const unsigned char *p, const unsigned char *end)
+{
+#if (HAVE_SSE2)
+    while (end-p >= 16) {
+        int mask = sse_delimiter_mask(_mm_loadu_si128((const __m128i*)p));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p<end && !is_delimiter(*p))
+        p++;
+    return p<end ? p : NULL;
+}
+
+static const unsigned char* scan_hexstr(const unsigned char *p, const unsigned char *end)
+{
+    const unsigned char *q = (const unsigned char*) memchr(p, '>', end-p);
+    return q ? q+1 : NULL;
+}
+
+// returns position of first '(' or ')' or '\\', or end if not found
+static inline const unsigned char* find_paren(const unsigned char *p, const unsigned char *end)
+{
+#if (HAVE_SSE2)
+    while (end-p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i m = _mm_cmpeq_epi8(_mm_or_si128(v, SSE_BYTE(0x01)), SSE_BYTE(')'));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, SSE_BYTE('\\')));
+        int mask = _mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p<end && *p!='(' && *p!=')' && *p!='\\')
+        p++;
+    return p;
 }
 
-static void mystring_add_char(mystring *str, char c)
+// literal string may contain balanced parentheses and escaped chars
+class LiteralScanner
+{
+public:
+    int depth = 0;
+    bool escaped = false;
+    const unsigned char* operator() (const unsigned char *p, const unsigned char *end) {
+        for (; p<end; p++) {
+            if (escaped){
+                escaped = false;
+                continue;
+            }
+            p = find_paren(p, end);
+            if (p==end)
+                break;
+            switch (*p){
+                case '\\':
+                    escaped = true;
+                    break;
+                case '(':
+                    depth++;
+                    break;
+                case ')':
+                    if (depth==0)
+                        return p+1;
+                    depth--;
+                    break;
+            }
+        }
+        return NULL;
+    }
+};
+
+// find keyword in data, returns NULL if not found
+static const char* find_keyword(const char *data, size_t len, const char *keyword, size_t kw_len)
 {
-    if (str->buff_size == str->len){
-        str->buff_size *= 2;
-        str->buff = (char*) realloc(str->buff, str->buff_size);
-        if (str->buff==NULL){
-            message(FATAL, "realloc() failed !");
+    if (len < kw_len)
+        return NULL;
+    const char *p = data, *last = data + len - kw_len;// last possible position
+#if (HAVE_SSE2)
+    // compare first and last char of keyword at 16 positions at a time,
+    // and compare whole keyword only at positions where both match
+    __m128i first = SSE_BYTE(keyword[0]);
+    __m128i last_char = SSE_BYTE(keyword[kw_len-1]);
+    for (; last-p >= 15; p+=16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)p);
+        __m128i b = _mm_loadu_si128((const __m128i*)(p+kw_len-1));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last_char)));
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            if (memcmp(p+i+1, keyword+1, kw_len-2)==0)
+                return p+i;
+            mask &= mask-1;
         }
     }
-    str->buff[str->len] = c;
-    str->len++;
+#endif
+    for (; p<=last; p++) {
+        if (*p==keyword[0] && memcmp(p, keyword, kw_len)==0)
+            return p;
+    }
+    return NULL;
+}
+
+/* Token data begins at start, which is in current buffer, scanning continues from
+ f->ptr. If scan() reaches end of buffer, and more data can be read from file, the
+ chars are copied to tok->buf before refilling the buffer. If start is NULL, first
+ chars of the token are already in tok->buf.
+ Returns false if EOF is reached before end of token */
+template <typename Scanner>
+static bool scan_token(MYFILE *f, Token *tok, const unsigned char *start, Scanner scan)
+{
+    const unsigned char *p = scan(f->ptr, f->end);
+    if (start!=NULL && (p!=NULL || f->eof==EOF)){// whole token is in buffer
+        f->ptr = (unsigned char*) (p ? p : f->end);
+        tok->data = (const char*) start;
+        tok->len = f->ptr - start;
+        return p!=NULL;
+    }
+    if (start!=NULL)
+        tok->buf.assign((const char*)start, f->ptr - start);
+    while (true) {
+        const unsigned char *stop = p ? p : f->end;
+        tok->buf.append((const char*)f->ptr, stop - f->ptr);
+        f->ptr = (unsigned char*) stop;
+        if (p!=NULL || slow_mygetc(f)==EOF)
+            break;
+        myungetc(f);
+        p = scan(f->ptr, f->end);
+    }
+    tok->data = tok->buf.data();
+    tok->len = tok->buf.size();
+    return p!=NULL;
 }
 
 
@@ -1105,12 +2256,17 @@ Token:: Token() {
 bool
 Token:: get (MYFILE * f)
 {
-    int c, minus=0, parenthes, number;
+    int c, minus=0;
+    int64_t number;
     double real_number, frac;
     // skip whitespace characters
     int newline = 0;
     while (1){
-        c = mygetc(f);
+        const unsigned char *p = skip_whitespace(f->ptr, f->end);
+        if (p > f->ptr)
+            newline = (p[-1]==CHAR_LF || p[-1]==CHAR_CR);
+        f->ptr = (unsigned char*) p;
+        c = mygetc(f);// refills buffer if whitespace continues till end of buffer
         switch (c){
             case EOF:
                 this->type = TOK_EOF;
@@ -1225,27 +2381,21 @@ end_wh_sp:
                 this->type = TOK_BDICT;
                 return true;
             }
-            //this->str.type=PDF_STR_HEX;
-            mystring mstr = mystring_new();
-            mystring_add_char(&mstr, '<');
-            /*hexadecimal string*/
-            while (c!=EOF && c!='>'){
-                mystring_add_char(&mstr,c);
-                c = mygetc(f);
+            if (c==EOF){
+                this->type = TOK_UNKNOWN;
+                return false;
             }
-            if (c=='>') {
-                mystring_add_char(&mstr, '>');
-                char *buff = (char*) realloc(mstr.buff, mstr.len);// shrink buffer
-                if (buff){// even realloc to smaller size may fail
-                    mstr.buff = buff;
-                }
+            myungetc(f);
+            const unsigned char *start = NULL;
+            if (f->ptr > f->buf)
+                start = f->ptr-1;
+            else // buffer was refilled after reading '<'
+                this->buf = "<";
+            if (scan_token(f, this, start, scan_hexstr)){
                 this->type = TOK_STR;
-                this->str.len = mstr.len;
-                this->str.data = mstr.buff;
                 return true;
             }
             //EOF
-            free(mstr.buff);
             this->type = TOK_UNKNOWN;
             return false;
         }
@@ -1260,82 +2410,17 @@ end_wh_sp:
             return false;
         }
         case '(': // literal string, it may contain balanced parentheses
-        {
-            parenthes = 0;
-            //this->str.type=PDF_STR_CHR;
-            mystring mstr = mystring_new();
-            mystring_add_char(&mstr, '(');
-            while ((c=mygetc(f))!=EOF){
-                switch(c){
-                    case '\\':
-                        mystring_add_char(&mstr,c);
-                        c = mygetc(f);
-                        break;
-                    case '(':
-                        parenthes++;
-                        break;
-                    case ')':
-                        if (parenthes==0){
-                            goto end_lit_str;
-                        }
-                        --parenthes;
-                        break;
-                }
-                mystring_add_char(&mstr,c);
-            }
-end_lit_str:
-            if (c==')') {
-                mystring_add_char(&mstr, ')');
-                char *buff = (char*) realloc(mstr.buff, mstr.len);// shrink buffer
-                if (buff){
-                    mstr.buff = buff;
-                }
+            if (scan_token(f, this, f->ptr-1, LiteralScanner())){
                 this->type = TOK_STR;
-                this->str.len = mstr.len;
-                this->str.data = mstr.buff;
                 return true;
             }
             // EOF
-            free(mstr.buff);
             this->type = TOK_UNKNOWN;
             return false;
-        }
         case '/':  //name object
-        {
-            int i=0;
-            while ((c=mygetc(f))!=EOF){
-                switch(c){
-                    case CHAR_FF:
-                    case CHAR_SP:
-                    case CHAR_TAB:
-                    case CHAR_LF:
-                    case CHAR_CR:
-                    case '<':
-                    case '>':
-                    case '{':
-                    case '}':
-                    case '/':
-                    case '%':
-                    case '(':
-                    case ')':
-                    case '[':
-                    case ']':
-                        myungetc(f);
-                        goto end_name;
-                }
-                if (i+1<PDF_NAME_MAX_LEN){
-                    this->name[i] = c;
-                    ++i;
-                }
-                else {
-                    break;
-                }
-            }
-end_name:
-            this->name[i] = 0;
+            scan_token(f, this, f->ptr, scan_regular);
             this->type = TOK_NAME;
             return true;
-        }
         case '%': //comment, skip characters to end of line, then find next token
             while ((c=mygetc(f))!=EOF && c!=CHAR_LF && c!=CHAR_CR)
                 ;
@@ -1348,57 +2433,63 @@ end_name:
                 return this->get(f);
             }
             break;
-        default:
-            int i=0;
-            do {
-            switch (c){
-                case CHAR_FF:
-                case CHAR_SP:
-                case CHAR_TAB:
-                case CHAR_LF:
-                case CHAR_CR:
-                case '<':
-                case '>':
-                case '{':
-                case '}':
-                case '/':
-                case '%':
-                case '(':
-                case ')':
-                case '[':
-                case ']':
-                    myungetc(f);
-                    goto end_id;
-                }
-                if (i+1<PDF_ID_MAX_LEN){
-                    this->id[i] = c;
-                    ++i;
-                }
-                else {
-                    break;
-                }
-            } while ((c=mygetc(f))!=EOF);
-end_id:
-            this->id[i] = 0;
+        default:// keyword, it has at least one char
+            scan_token(f, this, f->ptr-1, scan_regular);
             this->type = TOK_ID;
             return true;
     }
     return true;
 }
 
-void
-Token:: freeData()
+bool
+Token:: is (const char *keyword)
 {
-    switch (this->type) {
-        case TOK_STR:
-            free(this->str.data);
-            break;
-        default:
-            break;
+    return (size_t)len==strlen(keyword) && memcmp(data, keyword, len)==0;
+}
+
+
+
+Lexer:: Lexer(MYFILE *file) {
+    f = file;
+    cur = 0;
+    count = 0;
+}
+
+Lexer:: ~Lexer() {
+    if (count>0)
+        myfseek(f, pos[(cur+1)%3], SEEK_SET);
+}
+
+bool
+Lexer:: get()
+{
+    cur = (cur+1)%3;
+    if (count>0) {
+        count--;
+        return ok[cur];
     }
+    return ok[cur] = toks[cur].get(f);
 }
 
+Token&
+Lexer:: peek(int n)
+{
+    assert(n>=1 && n<=2);
+    while (count<n) {
+        count++;
+        int i = (cur+count)%3;
+        pos[i] = myftell(f);
+        ok[i] = toks[i].get(f);
+    }
+    return toks[(cur+n)%3];
+}
 
+void
+Lexer:: skip(int n)
+{
+    while (n--)
+        get();
+}
 
 static int char2int(char input)
 {
@@ -1411,6 +2502,46 @@ static int char2int(char input)
   throw std::invalid_argument("Invalid input string");
 }
 
+// decode n hex digits and append bytes to out. if n is odd, last digit is followed by 0
+static void hex_decode(const char *hex, int n, std::string &out)
+{
+    int i = 0;
+#if (HAVE_SSE2)
+    // 16 hex digits are converted to 8 bytes at a time, if all of them are valid
+    char bytes[16];
+    for (; i+16<=n; i+=16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(hex+i));
+        __m128i lower = _mm_or_si128(v, SSE_BYTE(0x20));
+        __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(v, SSE_BYTE('0'-1)), _mm_cmplt_epi8(v, SSE_BYTE('9'+1)));
+        __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, SSE_BYTE('a'-1)), _mm_cmplt_epi8(lower, SSE_BYTE('f'+1)));
+        if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha))!=0xffff)
+            break;
+        __m128i val = _mm_or_si128(_mm_and_si128(is_digit, _mm_sub_epi8(v, SSE_BYTE('0'))),
+                    _mm_andnot_si128(is_digit, _mm_sub_epi8(lower, SSE_BYTE('a'-10))));
+        // each 16 bit lane has high nibble in low byte, and low nibble in high byte
+        __m128i pairs = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(val, _mm_set1_epi16(0x00ff)), 4),
+                                     _mm_srli_epi16(val, 8));
+        _mm_storeu_si128((__m128i*)bytes, _mm_packus_epi16(pairs, pairs));
+        out.append(bytes, 8);
+    }
+#endif
+    for (; i+1<n; i+=2)
+        out.push_back(16*char2int(hex[i]) + char2int(hex[i+1]));
+    if (i<n)
+        out.push_back(16*char2int(hex[i]));
+}
+
+// allocate string and its data in a single block of current arena
+String* new_string (const char *data, int len)
+{
+    String *str = (String*) current_arena()->alloc(sizeof(String) + len + 1);
+    str->data = (char*)(str+1);
+    memcpy(str->data, data, len);
+    str->data[len] = 0;
+    str->len = len;
+    return str;
+}
+
 // convert literal and hex pdfstring to normal string
 std::string pdfstr2bytes(String str, int *str_type)
 {
@@ -1463,15 +2594,8 @@ std::string pdfstr2bytes(String str, int *str_type)
     else if (str.data[0]=='<' && str.data[str.len-1]=='>')
     {
         *str_type = HEX_STR;
-        // if no. of chars is odd, last char is assumed to be 0
-        if (str.len%2!=0)
-            str.data[str.len-1] = '0';
-
-        for (int i=1; i<str.len-1; i+=2)
-        {
-            int c = 16*char2int(str.data[i]) + char2int(str.data[i+1]);
-            out_str.push_back(c);
-        }
+        out_str.reserve((str.len-1)/2);
+        hex_decode(str.data+1, str.len-2, out_str);
     }
     return out_str;
 }
@@ -1510,38 +2634,47 @@ void bytes2pdfstr(std::string str, String &out_str, int str_type)
         }
         tmp_str.push_back(')');
     }
+    // string data is allocated in arena, so old data is not freed
     if (out_str.len < (int)tmp_str.size()) {
-        out_str.data = (char*) realloc(out_str.data, tmp_str.size());
-        if (out_str.data==NULL){
-            message(FATAL, "realloc() failed !");
-        }
+        out_str.data = current_arena()->copyString(tmp_str.data(), tmp_str.size());
+    }
+    else {
+        memcpy(out_str.data, tmp_str.data(), tmp_str.size());
     }
-    memcpy(out_str.data, tmp_str.data(), tmp_str.size());
     out_str.len = tmp_str.size();
 };
 
 // returns stream length on success and -1 on failure
-static int get_correct_stream_len(MYFILE *f, size_t begin)
+static off_t get_correct_stream_len(MYFILE *f, off_t begin)
 {
-    if (myfseek(f, begin, SEEK_SET)!=0)
-        return -1;
-    int n, len=0;
-    char buff[1024];
-
-    while ((n=myfread(buff, 1, 1024, f))!=0)
-    {
-        for (int i=0; i<=n-9; i++) {
-            if (strncmp(buff+i, "endstream", 9)==0){
-                len+=i;
-                goto endstream;
+    off_t len;
+    char buff[4096];
+    if (f->f==NULL) {// whole data is in memory, search without copying
+        off_t size = f->end - f->buf;
+        if (begin > size)
+            return -1;
+        const char *data = (const char*) f->buf + begin;
+        const char *found = find_keyword(data, size-begin, "endstream", 9);
+        if (found==NULL)
+            return -1;
+        len = found - data;
+    }
+    else {
+        off_t pos = begin;
+        while (true) {
+            if (myfseek(f, pos, SEEK_SET)!=0)
+                return -1;
+            size_t n = myfread(buff, 1, sizeof(buff), f);
+            const char *found = find_keyword(buff, n, "endstream", 9);
+            if (found) {
+                len = pos + (found-buff) - begin;
+                break;
             }
+            if (n<sizeof(buff))// we can not read further
+                return -1;
+            pos += n-8;// we will read again last 8 bytes in next loop
         }
-        if (n<1024)// we can not read further
-            return -1;
-        len += 1024-8;// we will read again last 8 bytes in next loop
-        myfseek(f, -8, SEEK_CUR);
     }
-endstream:
     // read two bytes before endstream keyword
     if (myfseek(f, begin+len-2, SEEK_SET)!=0)
         return -1;
@@ -1,16 +1,19 @@
 #pragma once
 /* This file is a part of pdfcook program, which is GNU GPLv2 licensed */
 #include <vector>
-#include <map>
 #include <set>
 #include <string>
+#include <thread>
+#include <atomic>
+#include "common.h"
 #include "fileio.h"
 
-#define PDF_NAME_MAX_LEN 255
-#define PDF_ID_MAX_LEN 255
 #define XREF_ENT_LEN 18// [10 digit obj no]<space>[5 digit gen no]<space>[f or n]
+#define XREF_MAX_OFFSET 9999999999LL // max offset that fits in xref table entry
 #define LLEN 256
 #define STARTXREF_OFFSET 64 // how much to seek from end to read startxref
+#define OBJSTM_MAX_OBJS 100 // max number of objects packed in an object stream
+#define PDF_MAX_NESTING 10000 // max depth of nested arrays and dicts in an object
 
 /*
   PDF includes eight basic types of objects: Boolean values, Integer and Real numbers,
@@ -19,6 +22,7 @@
   object is called an indirect object.
 */
 class Token;
+class Lexer;
 class PdfObject;
 class ObjectTable;
 
@@ -33,77 +37,167 @@ enum {
 };
 
 typedef bool    BoolObj;// keyword 'true' and 'false'
-typedef int     IntObj;
+typedef int64_t IntObj;
 typedef double  RealObj;// eg. 2.0, 0.2, 2., .2, +2.0, -2.0, -2., -.2 etc
-typedef char*   NameObj; // name starting with '/' , eg - /Page , /Count
+typedef int     NameObj; // atom of name starting with '/' , eg - /Page , /Count
 typedef String  StringObj; // (abcd) or <eaffbb00>
 
+String*     new_string (const char *data, int len);// allocated in current arena
 std::string pdfstr2bytes(String str, int *str_type);
 void        bytes2pdfstr(std::string str, String &out_str, int str_type);
 
 
-typedef std::vector<PdfObject*>::iterator ArrayIter;
+/* Names are interned, each distinct name gets a small integer (atom), so that names
+  are compared as integers and stored only once. Names used by the program get
+  fixed atoms (eg. NAME_Type), other names get atoms when first read. */
+#define PDF_NAME_LIST(X) \
+    X(Type) X(Subtype) X(Pages) X(Page) X(Kids) X(Count) X(Parent) X(Resources) \
+    X(Contents) X(MediaBox) X(CropBox) X(Rotate) X(Font) X(XObject) X(ProcSet) \
+    X(Length) X(Filter) X(DecodeParms) X(Predictor) X(Colors) X(BitsPerComponent) \
+    X(Columns) X(EarlyChange) X(Size) X(Root) X(Info) X(ID) X(Prev) X(Index) X(W) \
+    X(XRefStm) X(Encrypt) X(Standard) X(V) X(R) X(O) X(U) X(P) X(N) X(First) \
+    X(ObjStm) X(XRef) X(FormType) X(BBox) X(Matrix) X(FlateDecode) X(LZWDecode) \
+    X(ASCII85Decode) X(DCTDecode) X(RunLengthDecode) X(CCITTFaxDecode) X(JBIG2Decode) \
+    X(JPXDecode) X(Crypt)
 
+enum {
+#define X(name) NAME_##name,
+    PDF_NAME_LIST(X)
+#undef X
+    NAME_COUNT// number of predefined names
+};
+
+int         name_atom (const char *name);// returns atom of name, adds name if not found
+int         name_atom (const char *name, int len);// name need not be null terminated
+int         name_find (const char *name);// returns -1 if name not found
+const char* atom_name (int atom);
+
+
+/* Objects are allocated in the arena of current thread (see ArenaScope), and
+  memory is freed only when the arena is destroyed. Each PdfDocument has an arena
+  for its objects, so that destroying document does not need to free objects one by one. */
+#define ARENA_NEW_DELETE \
+    static void* operator new (size_t size) { return current_arena()->alloc(size); } \
+    static void operator delete (void *) {}
+
+// iterates array items as pointers
+class ArrayIter
+{
+public:
+    PdfObject *ptr;
+    ArrayIter(PdfObject *item) : ptr(item) {}
+    PdfObject* operator* () { return ptr; }
+    ArrayIter& operator++ ();
+    ArrayIter operator++ (int);
+    bool operator== (const ArrayIter &other) { return ptr==other.ptr; }
+    bool operator!= (const ArrayIter &other) { return ptr!=other.ptr; }
+};
+
+/* Items are stored by value in a block in arena, so an array of numbers
+  (eg. /MediaBox, /W) is a single block of values without pointers */
 class ArrayObj
 {
 public:
-    std::vector<PdfObject*> array;
+    PdfObject *items;
+    int len;
+    int capacity;
+    ARENA_NEW_DELETE
 
+    ArrayObj();
     int         count();
     PdfObject*  at (int index);
-    void        append (PdfObject *item);
+    void        append (PdfObject *item);// item is moved into array, and becomes empty
+    PdfObject*  newItem();// adds an empty item at end
+    void        removeLast();
     void        deleteItems();
-    int         write (FILE *f);
+    int         write (OutFile *f);
     //allows range based for-loop
     ArrayIter   begin();
     ArrayIter   end();
 };
 
-typedef std::map<std::string, PdfObject*>::iterator MapIter;
+typedef std::pair<int, PdfObject*> DictItem;// name atom of key and value
+typedef DictItem* DictIter;
 // filter class used to remove unnecessary items in dict
-typedef std::set<std::string> DictFilter;
+typedef std::set<int> DictFilter;
 
 class DictObj
 {
 public:
-    std::map<std::string, PdfObject*> dict;
-
-    bool        contains (std::string key);
-    PdfObject*  get (std::string key);
-    void        add (std::string key, PdfObject *val);
-    PdfObject*  newItem (std::string key);// if val exist, clear and return obj, else create new PdfObject
-    void        deleteItem (std::string key);
+    DictItem *items;// sorted by key atom, allocated in arena
+    int *order;// indexes of items in order of key names, used for writing
+    int len;
+    int capacity;
+    ARENA_NEW_DELETE
+
+    DictObj();
+    bool        contains (int key);
+    PdfObject*  get (int key);
+    PdfObject*  get (const char *key);
+    void        add (int key, PdfObject *val);
+    PdfObject*  newItem (int key);// if val exist, clear and return obj, else create new PdfObject
+    PdfObject*  newItem (const char *key);
+    void        deleteItem (int key);
     void        deleteItems();
-    void        setDict (std::map<std::string, PdfObject*> &map);
+    void        setItems (DictItem *new_items, int count);// take items in any order
     void        merge (DictObj *src_dict);// hard copy new items, overwrite old items
     void        filter (DictFilter &filter_set);// remove all objects which are not in filter_set
-    int         write (FILE *f);
-    MapIter     begin();
-    MapIter     end();
-    PdfObject* operator[] (std::string key);
+    int         write (OutFile *f);
+    DictIter    begin();
+    DictIter    end();
+    PdfObject* operator[] (int key);
+private:
+    DictIter    find (int key);// position where key is or should be inserted
+    DictIter    insert (DictIter pos, int key, PdfObject *val);
 };
 
 
+// a piece of stream data allocated in arena. data is never modified, so the
+// same data can be shared by chunks of many streams
+struct StreamChunk {
+    const char *data;
+    size_t len;
+    StreamChunk *next;
+};
+
+/* Stream data is not read while parsing. The stream keeps the input file and
+  position of data, and data is read only when load() is called. Unchanged
+  streams are written directly from input file to output file.
+  Content streams edited by commands keep their data as a list of chunks, so that
+  prepend() and append() do not copy the whole data. The chunks are joined when
+  load() is called, else they are written one by one.
+  Data is either in stream buffer, or in input file, or in chunks.
+*/
 class StreamObj
 {
 public:
-    size_t begin;//pos where stream begins in file
-    size_t len;
+    off_t begin;//pos where stream begins in file
+    size_t len;// total length of data
     bool decompressed;
     DictObj dict;
-    char *stream;
-    int write(FILE *f);
+    char *stream;// NULL if data is not loaded from file
+    MYFILE *file;// input file from where stream data is not loaded yet
+    StreamChunk *chunks;// NULL if data is not in chunks
+    StreamChunk *last_chunk;
+    Arena::Buffer *owner;// arena frees the data if this object is not deleted
+    ARENA_NEW_DELETE
+    bool load();// read data from file or join chunks
+    int write(OutFile *f);
     bool decompress();
-    bool compress (const char *filter);
+    bool compress (int filter);// filter is name atom, eg. NAME_FlateDecode
+    void prepend (const char *data, size_t size);// data is copied in arena
+    void append (const char *data, size_t size);
+    void append (StreamObj *src);// src data is moved into chunks and shared (not copied)
+    void copyChunks (StreamObj *src);// share data of chunks of src
 
     StreamObj();
     ~StreamObj();
 };
 
+// object no. and generation no. of an indirect object
 typedef struct {
     int major;
     int minor;
-    PdfObject *obj;
 } IndirectObj;
 
 
@@ -111,12 +205,13 @@ typedef struct {
 typedef enum {
     PDF_OBJ_BOOL, PDF_OBJ_INT, PDF_OBJ_REAL, PDF_OBJ_STR,
     PDF_OBJ_NAME, PDF_OBJ_ARRAY, PDF_OBJ_DICT, PDF_OBJ_STREAM,
-    PDF_OBJ_INDIRECT, PDF_OBJ_INDIRECT_REF, PDF_OBJ_NULL, PDF_OBJ_UNKNOWN
+    PDF_OBJ_INDIRECT_REF, PDF_OBJ_NULL, PDF_OBJ_UNKNOWN
 } ObjectType;
 
-// can't store objects inside union that contain std::map, vector (eg. DictObj).
-// So storing pointers of these objects inside union.
-
+/* Object is 16 bytes, scalar values are stored inside it. Strings and containers
+  are allocated in arena and only their pointer is stored.
+  Objects are copied bitwise when moved (eg. into array), so members of union
+  must not have constructor or destructor. */
 class PdfObject
 {
 public:
@@ -125,18 +220,22 @@ public:
         BoolObj     boolean;
         IntObj      integer;
         RealObj     real;
-        StringObj   str;
         NameObj     name;
+        StringObj   *str;// string data follows this struct in same block
         DictObj     *dict;// always allocates dict
         ArrayObj    *array;// always allocates array
         StreamObj   *stream;// always allocates stream, may allocate stream->stream
-        IndirectObj indirect;// always allocates indirect.obj if PDF_OBJ_INDIRECT
+        IndirectObj indirect;
     };
+    ARENA_NEW_DELETE
     PdfObject();
     void setType(ObjectType obj_type);
-    bool read (MYFILE *f, ObjectTable *xref, Token *last_tok);
+    // for indirect object (eg. 12 0 obj ... endobj), object inside it is read,
+    // and its obj no. and gen no. are stored in obj_id
+    bool read (MYFILE *f, ObjectTable *xref, IndirectObj *obj_id=NULL);
+    bool read (Lexer &lex, ObjectTable *xref, IndirectObj *obj_id=NULL);
     bool readFromString (const char *str);
-    int write (FILE *f);
+    int write (OutFile *f);
     int copyFrom (PdfObject *src_obj);
     void clear();
     ~PdfObject();
@@ -147,6 +246,32 @@ public:
     }
 */
 
+/* Visits an object and all objects inside it (array items, dict values and stream
+  dict values) in same order as recursive traversal, but using an explicit stack.
+  Indirect references are not followed, push() the referenced object to visit it.
+    ObjectWalker walker(obj);
+    while ((obj = walker.next()) != NULL) {...}
+*/
+class ObjectWalker
+{
+public:
+    ObjectWalker(PdfObject *obj) { push(obj); }
+    void push(PdfObject *obj) { stack.push_back(obj); }
+    PdfObject* next();
+private:
+    std::vector<PdfObject*> stack;
+};
+
+inline ArrayIter& ArrayIter:: operator++ () {
+    ptr++;
+    return *this;
+}
+inline ArrayIter ArrayIter:: operator++ (int) {
+    ArrayIter prev = *this;
+    ptr++;
+    return prev;
+}
+
 enum {
     XREF_INVALID,
     XREF_TABLE,
@@ -161,18 +286,19 @@ enum {
 
 int getXrefType(MYFILE *f);
 
-// always obj==NULL for free obj, and never NULL for nonfree obj
+// always obj==NULL for free obj, and never NULL for nonfree obj.
+// members are ordered so that the item is 32 bytes without padding holes
 typedef struct {
     PdfObject *obj;
-    int8_t type;  // free(f), nonfree(n), compressed
     int major;   // object no.
     int minor; // gen id for type 1, (always 0 for type 2)
     union {
-        int offset; // offset of obj from beginning of file (type 1 only)
+        off_t offset; // offset of obj from beginning of file (type 1 only)
         int next_free;// obj no of next free obj (type 0 only)
         int obj_stm; // obj no. of object stream where obj is stored (type 2 only)
     };
     int index;// index no. within the obj stream (for type 2)
+    int8_t type;  // free(f), nonfree(n), compressed
     bool used;
 } ObjectTableItem;
 
@@ -183,21 +309,79 @@ class ObjectTable
 {
 public:
     std::vector<ObjectTableItem> table;
+    MYFILE *file;// input file, stream objects read from it keep reference to this file
+    Arena arena;// all objects of the table are allocated here
+
+    ObjectTable();
 
     int count();
     void expandToFit(size_t size);
     int addObject (PdfObject *obj);
+    int reserveSlots (int count);// for objects added by multiple threads (see SlotScope)
     PdfObject* getObject(int major, int minor);
-    bool read (MYFILE *f, size_t xref_pos);
+    PdfObject* getObject(int major);// read object if not loaded yet
+    bool read (MYFILE *f, off_t xref_pos);
     bool read (PdfObject *stream, PdfObject *p_trailer);
     bool readObject(MYFILE *f, int major);
-    void readObjects(MYFILE *f);
-    void writeObjects(FILE *f);
-    void writeXref (FILE *f);
+    PdfObject* parseObject(MYFILE *f, int major);
+    bool readObjectStream(StreamObj *obj_stm, int obj_stm_no, std::vector<int> &members);
+    PdfObject* getLengthObject(MYFILE *f, int major, PdfObject &tmp_obj);
+    void readObjects(MYFILE *f);// read all objects using multiple threads
+    void writeObjects(OutFile *f);
+    void writeXref (OutFile *f);
+    void packObjects();// put objects in object streams before writing
+    void writeXrefStream (OutFile *f, PdfObject *trailer);
 
     ObjectTableItem& operator[] (int index);
 };
 
+/* Table can not grow while objects are added by multiple threads. So free slots are
+ reserved in table before that, and for the lifetime of this scope, objects added by
+ this thread are put in the slots from begin to end (excluding end) */
+class SlotScope
+{
+public:
+    SlotScope(ObjectTable *table, int begin, int end);
+    ~SlotScope();
+
+    ObjectTable *table;
+    int next;// next free slot
+    int end;
+private:
+    SlotScope *prev;
+};
+
+// run func(i, view) for i in 0 to count-1 using n_threads threads. If f is not NULL,
+// each thread gets a separate MYFILE (view) that reads from the buffer of f.
+// each thread allocates objects in its own arena, which is moved to given arena at end
+template <typename Func>
+void parallel_for(size_t count, int n_threads, MYFILE *f, Arena &arena, Func func)
+{
+    std::atomic<size_t> next(0);
+    n_threads = MAX(1, MIN((size_t)n_threads, count));
+    std::vector<Arena> arenas(n_threads);
+    auto worker = [&](int thread_no) {
+        ArenaScope scope(&arenas[thread_no]);
+        MYFILE *view = f ? myfdup(f) : NULL;
+        for (size_t i; (i = next++) < count; ) {
+            func(i, view);
+        }
+        if (view)
+            myfclose(view);
+    };
+    std::vector<std::thread> threads;
+    for (int i=1; i<n_threads; i++) {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);// main thread is also a worker
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    for (Arena &thread_arena : arenas) {
+        arena.adopt(thread_arena);
+    }
+}
+
 
 /* constants defining whitespace characters */
 enum  { CHAR_NULL=0, CHAR_TAB=9, CHAR_LF=10, CHAR_FF=12, CHAR_CR=13, CHAR_SP=32};
@@ -208,21 +392,46 @@ typedef enum {
     TOK_BARRAY, TOK_EARRAY, TOK_ID, TOK_EOF, TOK_UNKNOWN
 } TokType;
 
+/* Name (without '/'), keyword and string (with its delimiters) are not copied, data
+  points to the chars in input buffer, and is valid until the buffer is modified.
+  Only if buffer is refilled in middle of the token (file is not memory mapped),
+  the chars are collected in buf. data is not null terminated. */
 class Token
 {
 public:
     TokType type;
+    int64_t integer;
     double  real;
-    int     integer;
-    char    name[PDF_NAME_MAX_LEN];
-    char    id[PDF_ID_MAX_LEN];
-    String  str;
+    const char *data;// for TOK_NAME, TOK_ID and TOK_STR
+    int     len;
     bool    new_line;//if there is newline before parsed token
     int     sign;// 1='+', -1='-', 0=no sign
+    std::string buf;
 
     Token();
     bool get(MYFILE *f);
-    void freeData();
+    bool is (const char *keyword);// if token data is same as keyword
+};
+
+/* Tokens read ahead to check for "N G R" and "N G obj" are kept in a queue, and
+  returned by next get(), so the parser never seeks back. If tokens are left in
+  queue when lexer is destroyed, file is seeked back to the first of them. */
+class Lexer
+{
+public:
+    MYFILE *f;
+    Lexer(MYFILE *f);
+    ~Lexer();
+    bool get();// read next token, returns same as Token::get()
+    Token& tok() { return toks[cur]; }// last token returned by get()
+    Token& peek(int n);// n-th (1 or 2) token after current token
+    void skip(int n);
+private:
+    Token toks[3];// current token and queue of upto two tokens
+    bool ok[3];// return value of Token::get()
+    off_t pos[3];// file pos before each token
+    int cur;
+    int count;// number of tokens in queue
 };
 
 #define isInt(obj) (((obj)!=NULL) && ((obj)->type==PDF_OBJ_INT))
@@ -0,0 +1,102 @@
+#!/bin/sh
+# This file is a part of pdfcook program, which is GNU GPLv2 licensed
+#
+# Check reading and writing of PDF files larger than 4GB.
+# Usage : bigfile.sh [pdfcook] [size_in_MB]
+#
+# A sparse input file is generated, in which a large image stream is followed by
+# the page content stream and the page object, so they are at offsets above 4GB.
+# The file is copied with pdfcook, and each object offset in the xref table of
+# output file is checked. Needs about 'size' MB of free disk space for output.
+
+PDFCOOK=${1:-./pdfcook}
+SIZE_MB=${2:-4500}
+DIR=${TMPDIR:-/tmp}/pdfcook-bigfile.$$
+IN=$DIR/in.pdf
+OUT=$DIR/out.pdf
+
+fail() {
+    echo "bigfile : $*" >&2
+    rm -rf "$DIR"
+    exit 1
+}
+
+mkdir -p "$DIR" || exit 1
+
+# image of 1024 px width, whose data is SIZE_MB MB of zeros (black)
+width=1024
+height=$((SIZE_MB * 1024))
+len=$((width * height))
+
+off1=15
+obj1="1 0 obj
+<< /Type /Catalog /Pages 2 0 R >>
+endobj
+"
+off2=$((off1 + ${#obj1}))
+obj2="2 0 obj
+<< /Type /Pages /Kids [ 5 0 R ] /Count 1 >>
+endobj
+"
+off3=$((off2 + ${#obj2}))
+head3="3 0 obj
+<< /Type /XObject /Subtype /Image /Width $width /Height $height /ColorSpace /DeviceGray /BitsPerComponent 8 /Length $len >>
+stream
+"
+off4=$((off3 + ${#head3} + len + 18))
+data4="q 400 0 0 400 100 100 cm /Im0 Do Q"
+obj4="4 0 obj
+<< /Length ${#data4} >>
+stream
+$data4
+endstream
+endobj
+"
+off5=$((off4 + ${#obj4}))
+obj5="5 0 obj
+<< /Type /Page /Parent 2 0 R /MediaBox [ 0 0 595 842 ]
+/Resources << /XObject << /Im0 3 0 R >> >> /Contents 4 0 R >>
+endobj
+"
+xref=$((off5 + ${#obj5}))
+
+{
+    printf '%%PDF-1.4\n%%\342\343\317\323\n'
+    printf '%s%s%s' "$obj1" "$obj2" "$head3"
+} > "$IN" || fail "can not write $IN"
+# skip image data, the file is sparse where supported
+truncate -s $((off3 + ${#head3} + len)) "$IN" || fail "can not extend $IN"
+{
+    printf '\nendstream\nendobj\n'
+    printf '%s%s' "$obj4" "$obj5"
+    printf 'xref\n0 6\n0000000000 65535 f \n'
+    for off in $off1 $off2 $off3 $off4 $off5; do
+        printf '%010d 00000 n \n' $off
+    done
+    printf 'trailer\n<< /Size 6 /Root 1 0 R >>\nstartxref\n%d\n%%%%EOF\n' $xref
+} >> "$IN" || fail "can not write $IN"
+
+# make sure the generated file itself is consistent
+[ "$(tail -c +$((off5 + 1)) "$IN" | head -c 7)" = "5 0 obj" ] || fail "generated file is broken"
+
+"$PDFCOOK" -q "$IN" "$OUT" > /dev/null || fail "pdfcook failed to copy $IN"
+
+# each object of output must be found at the offset written in xref table
+tail -c 4096 "$OUT" | sed -n '/^xref/,/^trailer/p' | awk '
+    /^[0-9]+ [0-9]+$/ && NF==2 { num = $1; next }
+    $3=="n" { off = $1; sub(/^0+/, "", off); print num, (off=="" ? 0 : off) }
+    NF==3 { num++ }' > "$DIR/offsets"
+[ -s "$DIR/offsets" ] || fail "xref table not found in output"
+max=0
+while read num off; do
+    obj=$(tail -c +$((off + 1)) "$OUT" | head -c ${#num} ; printf '.')
+    [ "$obj" = "$num." ] || fail "object $num is not at offset $off in output"
+    [ $off -gt $max ] && max=$off
+done < "$DIR/offsets"
+[ $max -gt 4294967296 ] || fail "no object beyond 4GB in output, nothing was checked"
+
+# read the output again, objects after large stream must be parsed right
+"$PDFCOOK" 'info' "$OUT" /dev/null 2>&1 | grep -q 'Pages : 1' || fail "pdfcook failed to read $OUT"
+
+echo "bigfile : ok, last object at offset $max"
+rm -rf "$DIR"
@@ -0,0 +1,132 @@
+#!/bin/sh
+# This file is a part of pdfcook program, which is GNU GPLv2 licensed
+#
+# Check that pages inherit Resources of their parent Pages node.
+# Usage : resources.sh [pdfcook]
+#
+# The Pages node has a /Font with F1 and an /XObject with X1. Its kids have no
+# Resources, Resources without /Font, own direct or indirect /Font, or Resources
+# shared with a sibling. Each output page must have all fonts and xobjects that
+# it has itself and that it inherits. The Resources of Pages node is written once
+# as direct and once as indirect object, and the files are converted with and
+# without a page editing command.
+
+PDFCOOK=${1:-./pdfcook}
+DIR=${TMPDIR:-/tmp}/pdfcook-resources.$$
+
+fail() {
+    echo "resources : $*" >&2
+    rm -rf "$DIR"
+    exit 1
+}
+
+mkdir -p "$DIR" || exit 1
+
+# write_pdf <file> <obj1> <obj2> ... , object numbers start from 1
+write_pdf() {
+    file=$1
+    shift
+    printf '%%PDF-1.4\n' > "$file"
+    offsets=""
+    num=1
+    for obj in "$@"; do
+        offsets="$offsets $(wc -c < "$file")"
+        printf '%d 0 obj\n%s\nendobj\n' $num "$obj" >> "$file"
+        num=$((num + 1))
+    done
+    xref=$(wc -c < "$file")
+    {
+        printf 'xref\n0 %d\n0000000000 65535 f \n' $num
+        for off in $offsets; do
+            printf '%010d 00000 n \n' $off
+        done
+        printf 'trailer\n<< /Size %d /Root 1 0 R >>\nstartxref\n%d\n%%%%EOF\n' $num $xref
+    } >> "$file"
+}
+
+# Resources of Pages node, as direct dict or as reference to object 12
+parent_res='<< /Font << /F1 5 0 R >> /XObject << /X1 6 0 R >> >>'
+# expected resource names of each page
+expected="F1,X1 F1,X1 F1,F2,X1 F1,F2,X1 F1,F2,X1 F1,F3,X1"
+
+for variant in direct indirect; do
+    if [ $variant = direct ]; then
+        res=$parent_res
+    else
+        res='12 0 R'
+    fi
+    page='<< /Type /Page /Parent 2 0 R /Contents 7 0 R'
+    write_pdf "$DIR/$variant.pdf" \
+        '<< /Type /Catalog /Pages 2 0 R >>' \
+        "<< /Type /Pages /Kids [ 3 0 R 4 0 R 8 0 R 9 0 R 10 0 R 11 0 R ] /Count 6 /MediaBox [ 0 0 200 200 ] /Resources $res >>" \
+        "$page >>" \
+        "$page /Resources << /ProcSet [ /PDF ] >> >>" \
+        '<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica >>' \
+        "<< /Type /XObject /Subtype /Form /BBox [ 0 0 10 10 ] /Length 0 >>
+stream
+
+endstream" \
+        "<< /Length 29 >>
+stream
+BT /F1 12 Tf (x) Tj ET /X1 Do
+endstream" \
+        "$page /Resources << /Font << /F2 5 0 R >> >> >>" \
+        "$page /Resources 13 0 R >>" \
+        "$page /Resources 13 0 R >>" \
+        "$page /Resources << /Font 14 0 R >> >>" \
+        "$parent_res" \
+        '<< /Font << /F2 5 0 R >> >>' \
+        '<< /F3 5 0 R >>'
+
+    for cmd in "" "scale(0.5)"; do
+        out="$DIR/out.pdf"
+        if [ -z "$cmd" ]; then
+            "$PDFCOOK" -q "$DIR/$variant.pdf" "$out" > /dev/null
+        else
+            "$PDFCOOK" -q "$cmd" "$DIR/$variant.pdf" "$out" > /dev/null
+        fi || fail "pdfcook failed to convert $variant.pdf"
+
+        # print resource names reachable from Resources of each page, in page order
+        found=$(awk '
+        /^[0-9]+ 0 obj$/ { num = $1; text = ""; in_stream = 0; next }
+        /^stream$/ { in_stream = 1; next }
+        /^endobj$/ { obj[num] = text; next }
+        { if (!in_stream) text = text $0 "\n" }
+        # replace references with the referred objects, upto a few levels
+        function expand(str, depth,    out, n, rest) {
+            out = ""
+            while (match(str, /[0-9]+ 0 R/)) {
+                n = substr(str, RSTART, RLENGTH - 4) + 0
+                out = out substr(str, 1, RSTART - 1)
+                rest = substr(str, RSTART + RLENGTH)
+                out = out (depth > 0 ? expand(obj[n], depth - 1) : "")
+                str = rest
+            }
+            return out str
+        }
+        END {
+            match(obj[1], /\/Pages [0-9]+ 0 R/)
+            root = substr(obj[1], RSTART + 7, RLENGTH - 11) + 0
+            match(obj[root], /\/Kids \[[^]]*\]/)
+            kids = substr(obj[root], RSTART + 7, RLENGTH - 8)
+            n_kids = split(kids, kid, " ")
+            for (i = 1; i <= n_kids; i += 3) {
+                page = obj[kid[i] + 0]
+                # Resources is last item printed before /Type
+                start = index(page, "/Resources ")
+                res = substr(page, start, index(page, "/Type /Page") - start)
+                res = expand(res, 4)
+                names = ""
+                split("F1 F2 F3 X1", want, " ")
+                for (j = 1; j <= 4; j++)
+                    if (index(res, "/" want[j] " "))
+                        names = names (names == "" ? "" : ",") want[j]
+                printf "%s ", names
+            }
+        }' "$out")
+        [ "$found" = "$expected " ] || fail "$variant Resources, command '$cmd' : expected '$expected', got '$found'"
+    done
+done
+
+echo "resources : ok"
+rm -rf "$DIR"